@@ -20,7 +20,17 @@ LOCAL_MODULE := audio.primary.$(TARGET_BOOTLOADER_BOARD_NAME)
 LOCAL_MODULE_PATH := $(TARGET_OUT_SHARED_LIBRARIES)/hw
 LOCAL_MODULE_TAGS := optional
 
-LOCAL_SRC_FILES := audio_hw.c ril_interface.c
+LOCAL_SRC_FILES := audio_hw.c audio_arena.c audio_dsp.c audio_echo_delay.c audio_latency.c \
+	audio_mixer.c audio_route_cache.c audio_tap.c ril_interface.c
+
+# tinyalsa with mixer_ctl_set_array(): multi-value controls are set in a single ioctl
+ifeq ($(TINYALSA_HAS_MIXER_SET_ARRAY),true)
+LOCAL_CFLAGS += -DMIXER_HAS_SET_ARRAY
+endif
+
+ifeq ($(ARCH_ARM_HAVE_NEON),true)
+LOCAL_ARM_NEON := true
+endif
 
 LOCAL_C_INCLUDES += \
 	external/tinyalsa/include \
@@ -31,3 +41,16 @@ LOCAL_C_INCLUDES += \
 LOCAL_SHARED_LIBRARIES := liblog libcutils libtinyalsa libaudioutils libdl libexpat
 
 include $(BUILD_SHARED_LIBRARY)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := audio_dsp_benchmark
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_SRC_FILES := audio_dsp_benchmark.c
+
+ifeq ($(ARCH_ARM_HAVE_NEON),true)
+LOCAL_ARM_NEON := true
+endif
+
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2012 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "audio_arena.h"
+
+#define ARENA_ALIGN 8
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;                /* of data[] */
+    size_t used;
+    /* keeps data[] aligned on 32 bit targets */
+    uint64_t data[];
+};
+
+struct arena {
+    struct arena_chunk *chunks; /* the first one is the one being filled */
+    size_t chunk_size;
+    size_t total_size;
+};
+
+struct arena *arena_create(size_t chunk_size)
+{
+    struct arena *arena;
+
+    arena = (struct arena *)calloc(1, sizeof(struct arena));
+    if (!arena)
+        return NULL;
+
+    arena->chunk_size = chunk_size;
+    return arena;
+}
+
+void arena_destroy(struct arena *arena)
+{
+    struct arena_chunk *chunk;
+
+    while (arena->chunks) {
+        chunk = arena->chunks;
+        arena->chunks = chunk->next;
+        free(chunk);
+    }
+    free(arena);
+}
+
+static struct arena_chunk *new_chunk(struct arena *arena, size_t size)
+{
+    struct arena_chunk *chunk;
+
+    chunk = (struct arena_chunk *)malloc(sizeof(struct arena_chunk) + size);
+    if (!chunk)
+        return NULL;
+
+    chunk->size = size;
+    chunk->used = 0;
+    arena->total_size += size;
+    return chunk;
+}
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+    struct arena_chunk *chunk = arena->chunks;
+    void *p;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (size == 0)
+        size = ARENA_ALIGN;
+
+    if (!chunk || chunk->size - chunk->used < size) {
+        if (size > arena->chunk_size / 4) {
+            /* on its own, after the chunk being filled so that its space is not lost */
+            chunk = new_chunk(arena, size);
+            if (!chunk)
+                return NULL;
+            if (arena->chunks) {
+                chunk->next = arena->chunks->next;
+                arena->chunks->next = chunk;
+            } else {
+                chunk->next = NULL;
+                arena->chunks = chunk;
+            }
+        } else {
+            chunk = new_chunk(arena, arena->chunk_size);
+            if (!chunk)
+                return NULL;
+            chunk->next = arena->chunks;
+            arena->chunks = chunk;
+        }
+    }
+
+    p = (char *)chunk->data + chunk->used;
+    chunk->used += size;
+    return p;
+}
+
+char *arena_strdup(struct arena *arena, const char *s)
+{
+    size_t len = strlen(s) + 1;
+    char *p;
+
+    p = (char *)arena_alloc(arena, len);
+    if (p)
+        memcpy(p, s, len);
+    return p;
+}
+
+size_t arena_get_size(struct arena *arena)
+{
+    return arena->total_size;
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2012 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUDIO_ARENA_H
+#define AUDIO_ARENA_H
+
+#include <stddef.h>
+
+/* Arena: allocations carved out of large chunks and released all together when the arena
+ * is destroyed. Meant for data built once and kept until it is replaced as a whole, like
+ * the routes of the mixer configuration. Not thread safe. */
+
+struct arena;
+
+/* chunk_size is the size of the chunks allocated, larger allocations get a chunk each */
+struct arena *arena_create(size_t chunk_size);
+void arena_destroy(struct arena *arena);
+
+/* returns memory aligned for any type, NULL when out of memory */
+void *arena_alloc(struct arena *arena, size_t size);
+char *arena_strdup(struct arena *arena, const char *s);
+/* total size of the chunks allocated */
+size_t arena_get_size(struct arena *arena);
+
+#endif
@@ -0,0 +1,270 @@
+/*
+ * Copyright (C) 2012 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "audio_dsp.h"
+
+static void extract_channels_c(int16_t *dst, size_t dst_channels,
+                               const int16_t *src, size_t src_channels, size_t frames)
+{
+    size_t i;
+
+    if (dst_channels == 1) {
+        for (; frames > 0; frames--) {
+            *dst++ = *src;
+            src += src_channels;
+        }
+        return;
+    }
+
+    for (; frames > 0; frames--) {
+        for (i = 0; i < dst_channels; i++)
+            dst[i] = src[i];
+        dst += dst_channels;
+        src += src_channels;
+    }
+}
+
+void dsp_extract_channels(int16_t *dst, size_t dst_channels,
+                          const int16_t *src, size_t src_channels, size_t frames)
+{
+    if (dst_channels == src_channels) {
+        memcpy(dst, src, frames * src_channels * sizeof(int16_t));
+        return;
+    }
+
+#if defined(__ARM_NEON__)
+    /* 8 frames per iteration for the layouts used by the multi-mic configurations,
+     * the remaining frames go through the scalar loop */
+    if (dst_channels == 1 && src_channels == 2) {
+        for (; frames >= 8; frames -= 8) {
+            int16x8x2_t v = vld2q_s16(src);
+            vst1q_s16(dst, v.val[0]);
+            src += 16;
+            dst += 8;
+        }
+    } else if (dst_channels == 2 && src_channels == 3) {
+        for (; frames >= 8; frames -= 8) {
+            int16x8x3_t v = vld3q_s16(src);
+            int16x8x2_t o = { { v.val[0], v.val[1] } };
+            vst2q_s16(dst, o);
+            src += 24;
+            dst += 16;
+        }
+    } else if (dst_channels == 2 && src_channels == 4) {
+        for (; frames >= 8; frames -= 8) {
+            int16x8x4_t v = vld4q_s16(src);
+            int16x8x2_t o = { { v.val[0], v.val[1] } };
+            vst2q_s16(dst, o);
+            src += 32;
+            dst += 16;
+        }
+    }
+#endif
+
+    extract_channels_c(dst, dst_channels, src, src_channels, frames);
+}
+
+static void apply_gain_c(int16_t *buf, size_t samples, int16_t mant, int shift)
+{
+    int32_t v;
+
+    for (; samples > 0; samples--) {
+        v = ((int32_t)*buf * mant + (1 << 14)) >> 15;
+        v <<= shift;
+        if (v > INT16_MAX)
+            v = INT16_MAX;
+        else if (v < INT16_MIN)
+            v = INT16_MIN;
+        *buf++ = (int16_t)v;
+    }
+}
+
+void dsp_apply_gain(int16_t *buf, size_t samples, int16_t mant, int shift)
+{
+#if defined(__ARM_NEON__)
+    int16x8_t m = vdupq_n_s16(mant);
+    int16x8_t s = vdupq_n_s16((int16_t)shift);
+
+    /* rounding doubling multiply high is the Q15 product, the left shift saturates */
+    for (; samples >= 8; samples -= 8) {
+        int16x8_t v = vld1q_s16(buf);
+        v = vqrdmulhq_s16(v, m);
+        v = vqshlq_s16(v, s);
+        vst1q_s16(buf, v);
+        buf += 8;
+    }
+#endif
+
+    apply_gain_c(buf, samples, mant, shift);
+}
+
+static void delay_and_sum_c(int16_t *dst, size_t dst_channels, const int16_t *src,
+                            const int16_t *delayed, size_t src_channels, size_t frames)
+{
+    size_t i;
+    int16_t v;
+
+    for (; frames > 0; frames--) {
+        v = (int16_t)(((int32_t)src[0] + delayed[1]) >> 1);
+        for (i = 0; i < dst_channels; i++)
+            *dst++ = v;
+        src += src_channels;
+        delayed += src_channels;
+    }
+}
+
+void dsp_delay_and_sum(int16_t *dst, size_t dst_channels, const int16_t *src,
+                       const int16_t *delayed, size_t src_channels, size_t frames)
+{
+#if defined(__ARM_NEON__)
+    /* halving add: the average of the two microphones never saturates */
+    if (src_channels == 2 && dst_channels <= 2) {
+        for (; frames >= 8; frames -= 8) {
+            int16x8_t v = vhaddq_s16(vld2q_s16(src).val[0], vld2q_s16(delayed).val[1]);
+            if (dst_channels == 1) {
+                vst1q_s16(dst, v);
+            } else {
+                int16x8x2_t o = { { v, v } };
+                vst2q_s16(dst, o);
+            }
+            src += 16;
+            delayed += 16;
+            dst += 8 * dst_channels;
+        }
+    }
+#endif
+
+    delay_and_sum_c(dst, dst_channels, src, delayed, src_channels, frames);
+}
+
+void dsp_dc_blocker_init(struct dsp_dc_blocker *dc, unsigned int rate, unsigned int cutoff_hz)
+{
+    memset(dc, 0, sizeof(*dc));
+    /* a = 1 - 2 pi fc / fs */
+    dc->a = INT32_MAX - (int32_t)((int64_t)6283 * cutoff_hz * (1LL << 31) / (1000LL * rate));
+}
+
+static void dc_block_c(struct dsp_dc_blocker *dc, int16_t *buf, size_t channels,
+                       size_t filtered, size_t frames)
+{
+    size_t i;
+
+    for (; frames > 0; frames--) {
+        for (i = 0; i < filtered; i++) {
+            int32_t x = (int32_t)buf[i] << 8;
+            int32_t y = x - dc->x1[i] +
+                        (int32_t)(((int64_t)dc->y1[i] * dc->a + (1 << 30)) >> 31);
+
+            dc->x1[i] = x;
+            dc->y1[i] = y;
+            y = (y + 128) >> 8;
+            if (y > INT16_MAX)
+                y = INT16_MAX;
+            else if (y < INT16_MIN)
+                y = INT16_MIN;
+            buf[i] = (int16_t)y;
+        }
+        buf += channels;
+    }
+}
+
+void dsp_dc_block(struct dsp_dc_blocker *dc, int16_t *buf, size_t channels, size_t frames)
+{
+    size_t filtered = channels < DSP_DC_BLOCKER_MAX_CHANNELS ?
+                          channels : DSP_DC_BLOCKER_MAX_CHANNELS;
+    size_t i;
+
+    if (frames == 0)
+        return;
+
+    /* the first input is taken as the previous one: the filter starts without a step */
+    if (!dc->primed) {
+        for (i = 0; i < filtered; i++)
+            dc->x1[i] = (int32_t)buf[i] << 8;
+        dc->primed = true;
+    }
+
+#if defined(__ARM_NEON__)
+    /* the lanes hold the channels of a frame. The rounding doubling multiply high is the
+     * Q31 product, the narrowing shift rounds and saturates the outputs. */
+    if (channels == 2) {
+        int32x2_t a = vdup_n_s32(dc->a);
+        int32x2_t x1 = vld1_s32(dc->x1);
+        int32x2_t y1 = vld1_s32(dc->y1);
+
+        for (; frames >= 2; frames -= 2) {
+            int32x4_t x = vshll_n_s16(vld1_s16(buf), 8);
+            int32x2_t y0 = vadd_s32(vsub_s32(vget_low_s32(x), x1), vqrdmulh_s32(y1, a));
+
+            y1 = vadd_s32(vsub_s32(vget_high_s32(x), vget_low_s32(x)), vqrdmulh_s32(y0, a));
+            x1 = vget_high_s32(x);
+            vst1_s16(buf, vqrshrn_n_s32(vcombine_s32(y0, y1), 8));
+            buf += 4;
+        }
+        vst1_s32(dc->x1, x1);
+        vst1_s32(dc->y1, y1);
+    } else if (channels == 4) {
+        int32x4_t a = vdupq_n_s32(dc->a);
+        int32x4_t x1 = vld1q_s32(dc->x1);
+        int32x4_t y1 = vld1q_s32(dc->y1);
+
+        for (; frames > 0; frames--) {
+            int32x4_t x = vshll_n_s16(vld1_s16(buf), 8);
+
+            y1 = vaddq_s32(vsubq_s32(x, x1), vqrdmulhq_s32(y1, a));
+            x1 = x;
+            vst1_s16(buf, vqrshrn_n_s32(y1, 8));
+            buf += 4;
+        }
+        vst1q_s32(dc->x1, x1);
+        vst1q_s32(dc->y1, y1);
+    }
+#endif
+
+    dc_block_c(dc, buf, channels, filtered, frames);
+}
+
+int64_t dsp_dot_product(const int16_t *a, const int16_t *b, size_t n)
+{
+    int64_t sum = 0;
+
+#if defined(__ARM_NEON__)
+    int64x2_t acc = vdupq_n_s64(0);
+
+    /* products are accumulated separately for each half: the sum of two products of
+     * full scale samples does not fit in 32 bits */
+    for (; n >= 8; n -= 8) {
+        int16x8_t va = vld1q_s16(a);
+        int16x8_t vb = vld1q_s16(b);
+        acc = vpadalq_s32(acc, vmull_s16(vget_low_s16(va), vget_low_s16(vb)));
+        acc = vpadalq_s32(acc, vmull_s16(vget_high_s16(va), vget_high_s16(vb)));
+        a += 8;
+        b += 8;
+    }
+    sum = vgetq_lane_s64(acc, 0) + vgetq_lane_s64(acc, 1);
+#endif
+
+    for (; n > 0; n--)
+        sum += (int32_t)*a++ * *b++;
+
+    return sum;
+}
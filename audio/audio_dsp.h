@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2012 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUDIO_DSP_H
+#define AUDIO_DSP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Sample processing kernels used on the capture path. Each kernel has a NEON
+ * implementation and a scalar fallback used when NEON is not available. */
+
+/* Copies the first dst_channels of each interleaved frame of src to dst.
+ * dst_channels must not exceed src_channels and the buffers must not overlap. */
+void dsp_extract_channels(int16_t *dst, size_t dst_channels,
+                          const int16_t *src, size_t src_channels, size_t frames);
+
+/* Multiplies the samples in place by mant * 2^shift with rounding and saturation.
+ * mant is a Q15 fraction and shift must be in the range [0, 15]. */
+void dsp_apply_gain(int16_t *buf, size_t samples, int16_t mant, int shift);
+
+/* Delay-and-sum beamformer for two microphones: averages channel 0 of the frames of src
+ * with channel 1 of the frames of delayed, which are the same frames delayed by the
+ * steering delay, and writes the result to all the dst_channels of each frame of dst. */
+void dsp_delay_and_sum(int16_t *dst, size_t dst_channels, const int16_t *src,
+                       const int16_t *delayed, size_t src_channels, size_t frames);
+
+#define DSP_DC_BLOCKER_MAX_CHANNELS 4
+
+/* DC blocker: first order high-pass y[n] = x[n] - x[n-1] + a * y[n-1] run on every sample.
+ * The recursion is serial in time: the channels of a frame are filtered together. */
+struct dsp_dc_blocker {
+    int32_t x1[DSP_DC_BLOCKER_MAX_CHANNELS];    /* previous inputs in Q8 */
+    int32_t y1[DSP_DC_BLOCKER_MAX_CHANNELS];    /* previous outputs in Q8 */
+    int32_t a;                                  /* pole in Q31 */
+    bool primed;
+};
+
+/* resets the DC offsets and sets the cutoff frequency for the sampling rate specified */
+void dsp_dc_blocker_init(struct dsp_dc_blocker *dc, unsigned int rate, unsigned int cutoff_hz);
+
+/* Removes the DC offset from interleaved frames in place. Only the first
+ * DSP_DC_BLOCKER_MAX_CHANNELS channels of each frame are filtered. */
+void dsp_dc_block(struct dsp_dc_blocker *dc, int16_t *buf, size_t channels, size_t frames);
+
+/* Returns the sum of the products of the n samples of a and b. */
+int64_t dsp_dot_product(const int16_t *a, const int16_t *b, size_t n);
+
+#endif
@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2012 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Times the capture kernels of audio_dsp.c against their scalar fallbacks and checks that
+ * both produce the same output. Built without NEON, e.g. on the host, the kernels are the
+ * scalar fallbacks and only the timing is meaningful.
+ *
+ * usage: audio_dsp_benchmark [iterations] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* the scalar fallbacks are static */
+#include "audio_dsp.c"
+
+#define BENCH_FRAMES        1056    /* a capture period */
+#define BENCH_MAX_CHANNELS  4
+#define BENCH_ITERATIONS    2000
+#define BENCH_DELAY         7
+
+static int16_t src[(BENCH_FRAMES + BENCH_DELAY) * BENCH_MAX_CHANNELS];
+static int16_t dst_kernel[BENCH_FRAMES * BENCH_MAX_CHANNELS];
+static int16_t dst_scalar[BENCH_FRAMES * BENCH_MAX_CHANNELS];
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void report(const char *name, int64_t kernel_ns, int64_t scalar_ns, int iterations,
+                   bool match)
+{
+    double frames = (double)BENCH_FRAMES * iterations;
+
+    printf("%-22s kernel %7.3f ns/frame  scalar %7.3f ns/frame  x%.2f  %s\n", name,
+           kernel_ns / frames, scalar_ns / frames,
+           kernel_ns ? (double)scalar_ns / kernel_ns : 0.0, match ? "ok" : "MISMATCH");
+}
+
+static bool bench_extract(size_t dst_channels, size_t src_channels, int iterations)
+{
+    char name[32];
+    int64_t kernel_ns;
+    int64_t scalar_ns;
+    int64_t start;
+    bool match;
+    int i;
+
+    start = now_ns();
+    for (i = 0; i < iterations; i++)
+        dsp_extract_channels(dst_kernel, dst_channels, src, src_channels, BENCH_FRAMES);
+    kernel_ns = now_ns() - start;
+
+    start = now_ns();
+    for (i = 0; i < iterations; i++)
+        extract_channels_c(dst_scalar, dst_channels, src, src_channels, BENCH_FRAMES);
+    scalar_ns = now_ns() - start;
+
+    match = memcmp(dst_kernel, dst_scalar, BENCH_FRAMES * dst_channels * sizeof(int16_t)) == 0;
+    snprintf(name, sizeof(name), "extract %zu->%zu", src_channels, dst_channels);
+    report(name, kernel_ns, scalar_ns, iterations, match);
+    return match;
+}
+
+static bool bench_delay_and_sum(size_t dst_channels, int iterations)
+{
+    const int16_t *delayed = src;
+    const int16_t *current = src + BENCH_DELAY * 2;
+    char name[32];
+    int64_t kernel_ns;
+    int64_t scalar_ns;
+    int64_t start;
+    bool match;
+    int i;
+
+    start = now_ns();
+    for (i = 0; i < iterations; i++)
+        dsp_delay_and_sum(dst_kernel, dst_channels, current, delayed, 2, BENCH_FRAMES);
+    kernel_ns = now_ns() - start;
+
+    start = now_ns();
+    for (i = 0; i < iterations; i++)
+        delay_and_sum_c(dst_scalar, dst_channels, current, delayed, 2, BENCH_FRAMES);
+    scalar_ns = now_ns() - start;
+
+    match = memcmp(dst_kernel, dst_scalar, BENCH_FRAMES * dst_channels * sizeof(int16_t)) == 0;
+    snprintf(name, sizeof(name), "delay-and-sum 2->%zu", dst_channels);
+    report(name, kernel_ns, scalar_ns, iterations, match);
+    return match;
+}
+
+static bool bench_dc_block(size_t channels, int iterations)
+{
+    struct dsp_dc_blocker kernel;
+    struct dsp_dc_blocker scalar;
+    char name[32];
+    int64_t kernel_ns = 0;
+    int64_t scalar_ns = 0;
+    int64_t start;
+    bool match = true;
+    int i;
+
+    dsp_dc_blocker_init(&kernel, 44100, 10);
+    dsp_dc_blocker_init(&scalar, 44100, 10);
+    /* primed by the first block like dsp_dc_block() does */
+    for (i = 0; i < (int)channels; i++)
+        scalar.x1[i] = (int32_t)src[i] << 8;
+    scalar.primed = true;
+
+    /* the filters run in place and keep their state: both see the same input each time */
+    for (i = 0; i < iterations && match; i++) {
+        memcpy(dst_kernel, src, BENCH_FRAMES * channels * sizeof(int16_t));
+        memcpy(dst_scalar, src, BENCH_FRAMES * channels * sizeof(int16_t));
+
+        start = now_ns();
+        dsp_dc_block(&kernel, dst_kernel, channels, BENCH_FRAMES);
+        kernel_ns += now_ns() - start;
+
+        start = now_ns();
+        dc_block_c(&scalar, dst_scalar, channels, channels, BENCH_FRAMES);
+        scalar_ns += now_ns() - start;
+
+        match = memcmp(dst_kernel, dst_scalar,
+                       BENCH_FRAMES * channels * sizeof(int16_t)) == 0;
+    }
+
+    snprintf(name, sizeof(name), "dc block %zu", channels);
+    report(name, kernel_ns, scalar_ns, i, match);
+    return match;
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : BENCH_ITERATIONS;
+    bool ok = true;
+    size_t i;
+
+    if (iterations <= 0)
+        iterations = BENCH_ITERATIONS;
+
+    /* full scale noise with an offset exercises the saturation of the kernels */
+    srand(1);
+    for (i = 0; i < sizeof(src) / sizeof(src[0]); i++)
+        src[i] = (int16_t)((rand() & 0xffff) + 1000);
+
+    ok &= bench_extract(1, 2, iterations);
+    ok &= bench_extract(2, 3, iterations);
+    ok &= bench_extract(2, 4, iterations);
+    ok &= bench_delay_and_sum(1, iterations);
+    ok &= bench_delay_and_sum(2, iterations);
+    ok &= bench_dc_block(1, iterations);
+    ok &= bench_dc_block(2, iterations);
+    ok &= bench_dc_block(4, iterations);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
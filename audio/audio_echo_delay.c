@@ -0,0 +1,265 @@
+/*
+ * Copyright (C) 2012 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_primary"
+/*#define LOG_NDEBUG 0*/
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include <cutils/atomic.h>
+#include <cutils/log.h>
+#include <system/thread_defs.h>
+
+#include "audio_dsp.h"
+#include "audio_echo_delay.h"
+
+/* the signals are decimated to 4 kHz: 250 us resolution is well within what the AEC
+ * tolerates and keeps the correlation cheap */
+#define ECHO_DELAY_RATE         4000
+#define ECHO_DELAY_HISTORY      4000    /* 1 s */
+#define ECHO_DELAY_WINDOW       2000    /* 500 ms correlated for each lag */
+#define ECHO_DELAY_MAX_LAG      800     /* +/- 200 ms around the current alignment */
+#define ECHO_DELAY_PERIOD_MS    500
+/* minimum normalized correlation of the peak for the lag to be used */
+#define ECHO_DELAY_MIN_CORRELATION 0.3
+/* minimum mean square of the windows, below it the echo is not audible */
+#define ECHO_DELAY_MIN_ENERGY   (100.0 * 100.0)
+/* weight of a new measure in the smoothed delay, as a power of 2 */
+#define ECHO_DELAY_SMOOTHING_SHIFT 2
+
+struct echo_delay {
+    pthread_mutex_t lock;       /* protects the histories, generation and measured */
+    pthread_cond_t cond;        /* signaled on exit and when the history gets full */
+    pthread_t thread;
+    volatile int32_t exit;      /* also polled by the correlation without the lock */
+    uint32_t generation;        /* incremented by echo_delay_reset() */
+
+    unsigned int factor;        /* decimation factor */
+    int32_t mic_acc;
+    int32_t ref_acc;
+    unsigned int acc_count;
+
+    int16_t mic_hist[ECHO_DELAY_HISTORY];
+    int16_t ref_hist[ECHO_DELAY_HISTORY];
+    size_t hist_pos;
+    size_t hist_count;
+
+    /* thread private */
+    int16_t mic[ECHO_DELAY_HISTORY];
+    int16_t ref[ECHO_DELAY_HISTORY];
+
+    bool measured;              /* delay_us was measured since the last reset */
+
+    volatile int32_t delay_us;
+};
+
+/* returns the lag in decimated samples by which the echo in mic follows ref, or
+ * ECHO_DELAY_MAX_LAG + 1 if no lag is found with enough confidence */
+static int echo_delay_correlate(struct echo_delay *ed)
+{
+    const int16_t *mic = ed->mic + ECHO_DELAY_HISTORY - ECHO_DELAY_WINDOW - ECHO_DELAY_MAX_LAG;
+    const int16_t *ref;
+    double mic_energy;
+    double ref_energy;
+    double best = 0;
+    double corr;
+    int best_lag = ECHO_DELAY_MAX_LAG + 1;
+    int lag;
+
+    mic_energy = (double)dsp_dot_product(mic, mic, ECHO_DELAY_WINDOW);
+    if (mic_energy < ECHO_DELAY_MIN_ENERGY * ECHO_DELAY_WINDOW)
+        return best_lag;
+
+    /* the energy of the reference window is updated as it slides */
+    ref = mic - ed->mic + ed->ref - ECHO_DELAY_MAX_LAG;
+    ref_energy = (double)dsp_dot_product(ref, ref, ECHO_DELAY_WINDOW);
+
+    for (lag = ECHO_DELAY_MAX_LAG; lag >= -ECHO_DELAY_MAX_LAG; lag--) {
+        /* do not delay echo_delay_destroy() by a full correlation */
+        if (android_atomic_acquire_load(&ed->exit))
+            return ECHO_DELAY_MAX_LAG + 1;
+
+        ref = mic - ed->mic + ed->ref - lag;
+        if (lag != ECHO_DELAY_MAX_LAG)
+            ref_energy += (double)ref[ECHO_DELAY_WINDOW - 1] * ref[ECHO_DELAY_WINDOW - 1] -
+                              (double)ref[-1] * ref[-1];
+
+        if (ref_energy < ECHO_DELAY_MIN_ENERGY * ECHO_DELAY_WINDOW)
+            continue;
+
+        corr = fabs((double)dsp_dot_product(mic, ref, ECHO_DELAY_WINDOW)) /
+                   sqrt(mic_energy * ref_energy);
+        if (corr > best) {
+            best = corr;
+            best_lag = lag;
+        }
+    }
+
+    if (best < ECHO_DELAY_MIN_CORRELATION)
+        return ECHO_DELAY_MAX_LAG + 1;
+
+    ALOGV("%s: lag %d correlation %f", __func__, best_lag, best);
+    return best_lag;
+}
+
+static void *echo_delay_thread(void *context)
+{
+    struct echo_delay *ed = (struct echo_delay *)context;
+    struct timespec ts;
+    uint32_t generation;
+    size_t head;
+    int32_t delay_us;
+    int lag;
+
+    setpriority(PRIO_PROCESS, 0, ANDROID_PRIORITY_BACKGROUND);
+
+    pthread_mutex_lock(&ed->lock);
+    while (!ed->exit) {
+        if (ed->hist_count < ECHO_DELAY_HISTORY) {
+            pthread_cond_wait(&ed->cond, &ed->lock);
+            continue;
+        }
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += ECHO_DELAY_PERIOD_MS / 1000;
+        ts.tv_nsec += (ECHO_DELAY_PERIOD_MS % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_nsec -= 1000000000;
+            ts.tv_sec++;
+        }
+        pthread_cond_timedwait(&ed->cond, &ed->lock, &ts);
+        if (ed->exit || ed->hist_count < ECHO_DELAY_HISTORY)
+            continue;
+
+        /* unroll the histories, oldest sample first */
+        head = ECHO_DELAY_HISTORY - ed->hist_pos;
+        memcpy(ed->mic, ed->mic_hist + ed->hist_pos, head * sizeof(int16_t));
+        memcpy(ed->mic + head, ed->mic_hist, ed->hist_pos * sizeof(int16_t));
+        memcpy(ed->ref, ed->ref_hist + ed->hist_pos, head * sizeof(int16_t));
+        memcpy(ed->ref + head, ed->ref_hist, ed->hist_pos * sizeof(int16_t));
+        generation = ed->generation;
+        pthread_mutex_unlock(&ed->lock);
+
+        lag = echo_delay_correlate(ed);
+
+        pthread_mutex_lock(&ed->lock);
+        /* the histories correlated were discarded meanwhile */
+        if (generation != ed->generation || lag > ECHO_DELAY_MAX_LAG)
+            continue;
+
+        delay_us = lag * (1000000 / ECHO_DELAY_RATE);
+        if (ed->measured) {
+            int32_t current = android_atomic_acquire_load(&ed->delay_us);
+            delay_us = current + ((delay_us - current) >> ECHO_DELAY_SMOOTHING_SHIFT);
+        }
+        ed->measured = true;
+        android_atomic_release_store(delay_us, &ed->delay_us);
+    }
+    pthread_mutex_unlock(&ed->lock);
+
+    return NULL;
+}
+
+struct echo_delay *echo_delay_create(unsigned int rate)
+{
+    struct echo_delay *ed;
+
+    ed = (struct echo_delay *)calloc(1, sizeof(struct echo_delay));
+    if (!ed)
+        return NULL;
+
+    ed->factor = rate / ECHO_DELAY_RATE;
+    if (ed->factor == 0)
+        ed->factor = 1;
+    pthread_mutex_init(&ed->lock, NULL);
+    pthread_cond_init(&ed->cond, NULL);
+
+    if (pthread_create(&ed->thread, NULL, echo_delay_thread, ed) != 0) {
+        ALOGE("%s: cannot create estimator thread", __func__);
+        free(ed);
+        return NULL;
+    }
+
+    return ed;
+}
+
+void echo_delay_destroy(struct echo_delay *ed)
+{
+    pthread_mutex_lock(&ed->lock);
+    android_atomic_release_store(1, &ed->exit);
+    pthread_cond_signal(&ed->cond);
+    pthread_mutex_unlock(&ed->lock);
+
+    pthread_join(ed->thread, NULL);
+    free(ed);
+}
+
+void echo_delay_push(struct echo_delay *ed, const int16_t *mic, size_t mic_channels,
+                     const int16_t *ref, size_t ref_channels, size_t frames)
+{
+    /* never wait for the estimator thread: both signals are skipped together so that
+     * they stay aligned */
+    if (pthread_mutex_trylock(&ed->lock) != 0)
+        return;
+
+    /* decimation by averaging, a box filter is enough to limit aliasing for a correlation */
+    for (; frames > 0; frames--) {
+        ed->mic_acc += *mic;
+        ed->ref_acc += *ref;
+        mic += mic_channels;
+        ref += ref_channels;
+        if (++ed->acc_count < ed->factor)
+            continue;
+
+        ed->mic_hist[ed->hist_pos] = (int16_t)(ed->mic_acc / (int32_t)ed->factor);
+        ed->ref_hist[ed->hist_pos] = (int16_t)(ed->ref_acc / (int32_t)ed->factor);
+        ed->hist_pos = (ed->hist_pos + 1) % ECHO_DELAY_HISTORY;
+        if (ed->hist_count < ECHO_DELAY_HISTORY && ++ed->hist_count == ECHO_DELAY_HISTORY)
+            pthread_cond_signal(&ed->cond);
+        ed->mic_acc = 0;
+        ed->ref_acc = 0;
+        ed->acc_count = 0;
+    }
+
+    pthread_mutex_unlock(&ed->lock);
+}
+
+void echo_delay_reset(struct echo_delay *ed)
+{
+    pthread_mutex_lock(&ed->lock);
+    ed->mic_acc = 0;
+    ed->ref_acc = 0;
+    ed->acc_count = 0;
+    ed->hist_pos = 0;
+    ed->hist_count = 0;
+    ed->generation++;
+    ed->measured = false;
+    android_atomic_release_store(0, &ed->delay_us);
+    pthread_mutex_unlock(&ed->lock);
+}
+
+int32_t echo_delay_get_us(struct echo_delay *ed)
+{
+    return android_atomic_acquire_load(&ed->delay_us);
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2012 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUDIO_ECHO_DELAY_H
+#define AUDIO_ECHO_DELAY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Echo delay estimator: measures the lag between the echo reference given to the AEC and
+ * the echo found in the microphone signal by cross-correlating them. echo_delay_push()
+ * only decimates the signals into history buffers and never blocks, the correlation runs
+ * at low priority in a thread of the estimator every few hundred milliseconds once a full
+ * history was pushed. The thread sleeps while the history is not full. */
+
+struct echo_delay;
+
+/* rate is the sampling rate of the signals pushed */
+struct echo_delay *echo_delay_create(unsigned int rate);
+void echo_delay_destroy(struct echo_delay *ed);
+
+/* discards the history and the delay measured, e.g. when the signals are interrupted. A
+ * correlation in progress is not used. */
+void echo_delay_reset(struct echo_delay *ed);
+
+/* adds frames of the microphone signal and of the echo reference aligned with it, as
+ * passed to the AEC. Only the first channel of each is used. */
+void echo_delay_push(struct echo_delay *ed, const int16_t *mic, size_t mic_channels,
+                     const int16_t *ref, size_t ref_channels, size_t frames);
+
+/* returns the smoothed delay in us to add to the delay given to the AEC, 0 until the
+ * lag was measured with enough confidence */
+int32_t echo_delay_get_us(struct echo_delay *ed);
+
+#endif
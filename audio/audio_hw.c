@@ -22,12 +22,22 @@
 #define LOG_NDEBUG 0
 
 #include <errno.h>
+#include <limits.h>
+#include <math.h>
 #include <pthread.h>
 #include <stdint.h>
 #include <sys/time.h>
+#include <time.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <expat.h>
 
+#include <cutils/atomic.h>
 #include <cutils/log.h>
 #include <cutils/str_parms.h>
 #include <cutils/properties.h>
@@ -43,6 +53,13 @@
 #include <audio_effects/effect_aec.h>
 
 #include "audio_hw.h"
+#include "audio_arena.h"
+#include "audio_dsp.h"
+#include "audio_echo_delay.h"
+#include "audio_latency.h"
+#include "audio_mixer.h"
+#include "audio_route_cache.h"
+#include "audio_tap.h"
 #include "ril_interface.h"
 
 struct pcm_config pcm_config_mm = {
@@ -71,6 +88,14 @@ struct pcm_config pcm_config_capture = {
     .format = PCM_FORMAT_S16_LE,
 };
 
+struct pcm_config pcm_config_capture_voip = {
+    .channels = 2,
+    .rate = DEFAULT_IN_SAMPLING_RATE,
+    .period_size = VOIP_CAPTURE_PERIOD_SIZE,
+    .period_count = VOIP_CAPTURE_PERIOD_COUNT,
+    .format = PCM_FORMAT_S16_LE,
+};
+
 struct pcm_config pcm_config_vx = {
     .channels = 2,
     .rate = VX_NB_SAMPLING_RATE,
@@ -80,26 +105,127 @@ struct pcm_config pcm_config_vx = {
 };
 
 #define MIN(x, y) ((x) > (y) ? (y) : (x))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+/* One capture PCM shared by all active input streams. Frames read from the driver are
+ * stored in a ring and each client keeps its own read position in it, so that several
+ * clients (e.g. hotword detection and a recorder) can capture at the same time.
+ * clients[] and num_clients are modified with both the hw device and capture mutexes
+ * locked.
+ * The capture mutex is released while a period is read from the driver: a single thread
+ * reads at a time, with reading set, and publishes the period by advancing frames_written
+ * once complete, along with the driver timestamp matching it.
+ * When the last client stops, the PCM and the microphone route stay open and idle_thread
+ * keeps draining the PCM into the ring until a client starts again: indefinitely with
+ * pre-roll enabled, for warm_standby_ms otherwise. */
+struct espresso_capture {
+    pthread_mutex_t lock;       /* see note below on mutex acquisition order */
+    struct pcm *pcm;
+    struct pcm_config config;
+    int16_t *ring;
+    size_t ring_frames;
+    uint64_t frames_written;
+    bool reading;               /* a period is being read into the ring */
+    pthread_cond_t read_cond;   /* signaled when reading is cleared */
+    /* driver timestamp taken when frames_written was last advanced */
+    bool read_tstamp_valid;
+    unsigned int read_avail;
+    struct timespec read_tstamp;
+    struct espresso_stream_in *clients[MAX_CAPTURE_CLIENTS];
+    int num_clients;
+    bool dual_mic;              /* right channel from the sub mic instead of the main mic */
+
+    unsigned int preroll_ms;    /* 0: pre-roll disabled */
+    unsigned int warm_standby_ms;
+    int64_t idle_since_ns;      /* CLOCK_MONOTONIC time the last client stopped */
+    pthread_t idle_thread;
+    pthread_cond_t idle_cond;
+    bool idle_running;
+    bool idle_exit;
+};
+
+/* control writes of a transition between two combinations of device configurations, in the
+ * order they are applied: the on entries, then the off entries */
+struct route_plan {
+    uint32_t from_cfgs;         /* set of the device configurations selected before */
+    uint32_t cfgs;              /* set of the device configurations selected */
+    struct route_setting **entries;
+    unsigned int num_entries;
+};
+
+/* routes parsed from the mixer configuration file. A table is not modified once built,
+ * except for its plan cache, and is replaced as a whole when the file changes: only the
+ * routing thread uses the table installed and frees it once it is replaced. */
+struct route_table {
+    struct espresso_dev_cfg *dev_cfgs;
+    int num_dev_cfgs;
+    struct route_setting *defaults;     /* paths outside of the devices and use cases */
+    unsigned int defaults_len;
+    struct arena *arena;                /* holds the routes of dev_cfgs and their names */
+    struct route_cache *cache;          /* holds the control names when loaded from it */
+    /* by device bit: set of the device configurations selecting the device */
+    uint32_t out_dev_cfgs[32];
+    uint32_t in_dev_cfgs[32];
+    /* by use case: set of the use case configurations selected by it */
+    uint32_t use_case_cfgs[USE_CASE_CNT];
+    struct route_plan plans[ROUTE_PLAN_CACHE_SIZE];
+    unsigned int num_plans;
+    unsigned int next_plan;     /* replaced when the cache is full */
+};
 
 struct espresso_audio_device {
     struct audio_hw_device hw_device;
 
     pthread_mutex_t lock;       /* see note below on mutex acquisition order */
-    struct espresso_dev_cfg *dev_cfgs;
-    int num_dev_cfgs;
+    struct route_table *route_table;    /* used by the routing thread only */
     struct mixer *mixer;
+    /* all the control writes go through it. Owned by the routing thread, which is the only
+     * one writing controls: other threads only look up control ids, which do not change. */
+    struct mixer_shadow *mixer_shadow;
+    struct route_setting **route_target;    /* by control id, see route_build_plan() */
+    bool *route_touched;                    /* by control id, see route_build_plan() */
+
+    /* routing thread mailbox: only the last devices requested are applied */
+    pthread_mutex_t route_lock;
+    pthread_cond_t route_cond;
+    pthread_t route_thread;
+    bool route_exit;
+    int route_out_device;
+    int route_in_device;
+    uint32_t route_use_cases;
+    uint32_t route_requested;   /* sequence number of the last request */
+    uint32_t route_applied;     /* sequence number of the last request applied */
+    int64_t route_request_ns;   /* CLOCK_MONOTONIC time of the last request */
+    int route_in_volumes[IN_PGA_CNT];   /* applied after the route if pending */
+    bool route_in_volumes_pending;
+    struct route_table *route_next_table;   /* replaces route_table before the next route */
+
+    /* configuration watcher, see config_watch_thread() */
+    bool config_watch;
+    pthread_t config_thread;
+    int config_exit_pipe[2];
     audio_mode_t mode;
     int active_out_device;
     int out_device;
     int active_in_device;
     int in_device;
+    int stats_out_device;       /* output device of the last select_output_device() */
+    struct latency_stats *route_stats;  /* durations of the route changes by device pair */
+    uint32_t active_use_cases;
+    uint32_t active_cfgs;       /* device configurations applied with the route table */
+    uint32_t use_cases;         /* set of the use cases selected, see USE_CASE_BIT() */
     struct pcm *pcm_modem_dl;
     struct pcm *pcm_modem_ul;
     struct pcm *pcm_bt_dl;
     struct pcm *pcm_bt_ul;
     int in_call;
     float voice_volume;
-    struct espresso_stream_in *active_input;
+    struct espresso_capture capture;
+    int in_gain_steps;          /* PGA steps above 0 dB applied to the active microphone */
+    volatile int32_t tap_enabled;       /* read by the audio threads without the lock */
+    struct tap_writer *tap_writer;
+    bool echo_delay_estimation;
+    int dc_block_devices;       /* input devices captured through the DC blocker */
     struct espresso_stream_out *outputs[OUTPUT_TOTAL];
     bool mic_mute;
     int tty_mode;
@@ -127,16 +253,20 @@ struct espresso_stream_out {
     bool use_long_periods;
     audio_channel_mask_t channel_mask;
     audio_channel_mask_t sup_channel_masks[3];
+    struct tap *tap;
 
     struct espresso_audio_device *dev;
 };
 
-#define MAX_PREPROCESSORS 3 /* maximum one AGC + one NS + one AEC per input stream */
+#define PREPROCESSORS_INITIAL_SIZE 3 /* one AGC + one NS + one AEC per input stream */
 
 struct effect_info_s {
     effect_handle_t effect_itfe;
     size_t num_channel_configs;
     channel_config_t* channel_configs;
+    bool bypassed;              /* last process() call returned -ENODATA */
+    uint64_t process_ns;
+    uint32_t process_count;
 };
 
 #define NUM_IN_AUX_CNL_CONFIGS 2
@@ -150,15 +280,40 @@ struct espresso_stream_in {
 
     pthread_mutex_t lock;       /* see note below on mutex acquisition order */
     struct pcm_config config;
-    struct pcm *pcm;
+    uint64_t capture_pos;
+    uint32_t frames_lost;
+    int64_t frames_read;
+    bool muted;
+    uint64_t mute_frames_rem;   /* capture frames owed when skipping at another rate */
+
+    /* capture gain: the analog PGA steps are set by capture_update_gains() and the
+     * remainder is applied digitally as gain_mant (Q15) * 2^gain_shift */
+    float gain;
+    int analog_gain_steps;
+    float applied_gain;
+    int applied_gain_steps;
+    int16_t gain_mant;
+    int gain_shift;
+
+    struct tap *tap;
+
+    bool beamformer;
+    unsigned int beamformer_delay;
+
+    bool dc_block;
+    struct dsp_dc_blocker dc_blocker;
+
     int device;
     struct resampler_itfe *resampler;
     struct resampler_buffer_provider buf_provider;
+    int resampler_quality;          /* quality the resampler was created with */
+    int resampler_quality_override; /* -1 to choose by source */
     unsigned int requested_rate;
     int standby;
     int source;
     struct echo_reference_itfe *echo_reference;
     bool need_echo_reference;
+    struct echo_delay *echo_delay;
 
     int16_t *read_buf;
     size_t read_buf_size;
@@ -166,6 +321,7 @@ struct espresso_stream_in {
 
     int16_t *proc_buf_in;
     int16_t *proc_buf_out;
+    int16_t *stage_buf[2];      /* ping-pong buffers between preprocessing stages */
     size_t proc_buf_size;
     size_t proc_buf_frames;
 
@@ -176,7 +332,8 @@ struct espresso_stream_in {
     int read_status;
 
     int num_preprocessors;
-    struct effect_info_s preprocessors[MAX_PREPROCESSORS];
+    int preprocessors_size;
+    struct effect_info_s *preprocessors;
 
     bool aux_channels_changed;
     uint32_t main_channels;
@@ -186,6 +343,7 @@ struct espresso_stream_in {
 
 struct espresso_dev_cfg {
     int mask;
+    uint32_t use_cases;         /* set of the use cases selecting it, 0 for a device */
 
     struct route_setting *on;
     unsigned int on_len;
@@ -196,158 +354,532 @@ struct espresso_dev_cfg {
 
 /**
  * NOTE: when multiple mutexes have to be acquired, always respect the following order:
- *        hw device > in stream > out stream
+ *        hw device > in stream > capture > out stream
+ * The route mutex is only held around mailbox accesses and never while acquiring another
+ * mutex. The mixer shadow needs no mutex: only the routing thread writes controls.
  */
 
 static void select_output_device(struct espresso_audio_device *adev);
 static void select_input_device(struct espresso_audio_device *adev);
+static void capture_start_preroll(struct espresso_audio_device *adev);
+static void capture_stop_idle(struct espresso_audio_device *adev);
+static int64_t timespec_to_ns(const struct timespec *ts);
+
+static const char * const route_stage_names[ROUTE_STAGE_CNT] = {
+    [ROUTE_STAGE_QUEUE] = "queue",
+    [ROUTE_STAGE_MIXER] = "mixer",
+    [ROUTE_STAGE_PCM] = "pcm",
+    [ROUTE_STAGE_RIL] = "ril",
+    [ROUTE_STAGE_OUTPUT] = "output",
+    [ROUTE_STAGE_MODE] = "mode",
+};
+
+static const char * const in_pga_names[IN_PGA_CNT] = {
+    [IN_PGA_MAIN_MIC] = "IN1L Volume",
+    [IN_PGA_HEADSET_MIC] = "IN1R Volume",
+    [IN_PGA_SUB_MIC] = "IN2R Volume",
+};
+
+static int64_t route_time_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return timespec_to_ns(&now);
+}
+
+/* records the time elapsed since start_ns in a stage of a change of the output device */
+static void route_stat(struct espresso_audio_device *adev, enum route_stage stage,
+                       int from, int to, int64_t start_ns)
+{
+    if (adev->route_stats)
+        latency_stats_add(adev->route_stats, stage, from, to, route_time_ns() - start_ns);
+}
 static int adev_set_voice_volume(struct audio_hw_device *dev, float volume);
 static int do_input_standby(struct espresso_stream_in *in);
 static int do_output_standby(struct espresso_stream_out *out);
 static void in_update_aux_channels(struct espresso_stream_in *in, effect_handle_t effect);
+static int get_next_buffer(struct resampler_buffer_provider *buffer_provider,
+                                   struct resampler_buffer* buffer);
+static void release_buffer(struct resampler_buffer_provider *buffer_provider,
+                                  struct resampler_buffer* buffer);
 
-/* The enable flag when 0 makes the assumption that enums are disabled by
- * "Off" and integers/booleans by 0 */
-static int set_bigroute_by_array(struct mixer *mixer, struct route_setting *route,
-                              int enable)
+/* returns the shadow id of the mixer control of a route entry, looked up by name only the
+ * first time, or -1 if the control does not exist */
+static int route_get_ctl(struct mixer_shadow *shadow, struct route_setting *route)
 {
-    struct mixer_ctl *ctl;
-    unsigned int i, j, ret;
+    if (!route->resolved) {
+        route->ctl_id = mixer_shadow_find(shadow, route->ctl_name);
+        route->resolved = true;
+    }
 
-    /* Go through the route array and set each value */
-    i = 0;
-    while (route[i].ctl_name) {
-        ctl = mixer_get_ctl_by_name(mixer, route[i].ctl_name);
-        if (!ctl) {
-        ALOGE("Unknown control '%s'\n", route[i].ctl_name);
-            return -EINVAL;
-        }
+    return route->ctl_id;
+}
 
-        if (route[i].strval) {
-            if (enable) {
-                ret = mixer_ctl_set_enum_by_string(ctl, route[i].strval);
-                if (ret != 0) {
-                    ALOGE("Failed to set '%s' to '%s'\n", route[i].ctl_name, route[i].strval);
-                } else {
-                    ALOGV("Set '%s' to '%s'\n", route[i].ctl_name, route[i].strval);
-                }
-            } else {
-                ret = mixer_ctl_set_enum_by_string(ctl, "Off");
-                if (ret != 0) {
-                    ALOGE("Failed to set '%s' to '%s'\n", route[i].ctl_name, route[i].strval);
-                } else {
-                    ALOGV("Set '%s' to '%s'\n", route[i].ctl_name, "Off");
-                }
-            }
-        } else {
-            /* This ensures multiple (i.e. stereo) values are set jointly */
-            for (j = 0; j < mixer_ctl_get_num_values(ctl); j++) {
-                if (enable) {
-                    ret = mixer_ctl_set_value(ctl, j, route[i].intval);
-                    if (ret != 0) {
-                        ALOGE("Failed to set '%s' to '%d'\n", route[i].ctl_name, route[i].intval);
-                    } else {
-                        ALOGV("Set '%s' to '%d'\n", route[i].ctl_name, route[i].intval);
-                    }
-                } else {
-                    ret = mixer_ctl_set_value(ctl, j, 0);
-                    if (ret != 0) {
-                        ALOGE("Failed to set '%s' to '%d'\n", route[i].ctl_name, route[i].intval);
-                    } else {
-                        ALOGV("Set '%s' to '%d'\n", route[i].ctl_name, 0);
-                    }
-                }
-            }
-        }
-        i++;
+/* writes a route entry, or its disabled value, through the mixer shadow: controls already
+ * set to the value are not written */
+static int set_route_entry(struct mixer_shadow *shadow, struct route_setting *route,
+                           int enable)
+{
+    int id;
+    int ret;
+
+    id = route_get_ctl(shadow, route);
+    if (id < 0) {
+        ALOGE("Unknown control '%s'\n", route->ctl_name);
+        return -EINVAL;
+    }
+
+    if (route->strval) {
+        const char *strval = enable ? route->strval : "Off";
+
+        ret = mixer_shadow_set_enum(shadow, id, strval);
+        if (ret != 0)
+            ALOGE("Failed to set '%s' to '%s'\n", route->ctl_name, strval);
+        else
+            ALOGV("Set '%s' to '%s'\n", route->ctl_name, strval);
+    } else {
+        int intval = enable ? route->intval : 0;
+
+        /* This ensures multiple (i.e. stereo) values are set jointly */
+        ret = mixer_shadow_set_int(shadow, id, intval);
+        if (ret != 0)
+            ALOGE("Failed to set '%s' to '%d'\n", route->ctl_name, intval);
+        else
+            ALOGV("Set '%s' to '%d'\n", route->ctl_name, intval);
     }
 
     return 0;
 }
 
-/* The enable flag when 0 makes the assumption that enums are disabled by
- * "Off" and integers/booleans by 0 */
-static int set_route_by_array(struct mixer *mixer, struct route_setting *route,
+static int set_route_by_array(struct mixer_shadow *shadow, struct route_setting *route,
                   unsigned int len)
 {
-    struct mixer_ctl *ctl;
-    unsigned int i, j, ret;
+    unsigned int i;
+    int ret;
 
     /* Go through the route array and set each value */
     for (i = 0; i < len; i++) {
-        ctl = mixer_get_ctl_by_name(mixer, route[i].ctl_name);
-        if (!ctl) {
-        ALOGE("Unknown control '%s'\n", route[i].ctl_name);
-            return -EINVAL;
+        ret = set_route_entry(shadow, &route[i], 1);
+        if (ret != 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+/* builds the device bit and use case tables once the routes are parsed: the masks of
+ * the input devices include AUDIO_DEVICE_BIT_IN, which adev->in_device does not.
+ * The use cases are moved after the devices, keeping their order, so that their paths
+ * override those of the devices in route_build_plan(). */
+static void compile_dev_cfgs(struct route_table *table)
+{
+    struct espresso_dev_cfg *cfg;
+    struct espresso_dev_cfg tmp;
+    int bit;
+    int i, j;
+
+    memset(table->out_dev_cfgs, 0, sizeof(table->out_dev_cfgs));
+    memset(table->in_dev_cfgs, 0, sizeof(table->in_dev_cfgs));
+    memset(table->use_case_cfgs, 0, sizeof(table->use_case_cfgs));
+
+    for (i = 1; i < table->num_dev_cfgs; i++) {
+        tmp = table->dev_cfgs[i];
+        for (j = i; j > 0 && !tmp.use_cases && table->dev_cfgs[j - 1].use_cases; j--)
+            table->dev_cfgs[j] = table->dev_cfgs[j - 1];
+        table->dev_cfgs[j] = tmp;
+    }
+
+    for (i = 0; i < table->num_dev_cfgs && i < MAX_DEV_CFGS; i++) {
+        cfg = &table->dev_cfgs[i];
+        for (bit = 0; bit < USE_CASE_CNT; bit++) {
+            if (cfg->use_cases & USE_CASE_BIT(bit))
+                table->use_case_cfgs[bit] |= 1u << i;
         }
+        for (bit = 0; bit < 32; bit++) {
+            if (!(cfg->mask & ~AUDIO_DEVICE_BIT_IN & (1u << bit)))
+                continue;
+            if (cfg->mask & AUDIO_DEVICE_BIT_IN)
+                table->in_dev_cfgs[bit] |= 1u << i;
+            else
+                table->out_dev_cfgs[bit] |= 1u << i;
+        }
+    }
 
-        if (route[i].strval) {
-        ret = mixer_ctl_set_enum_by_string(ctl, route[i].strval);
-        if (ret != 0) {
-        ALOGE("Failed to set '%s' to '%s'\n",
-             route[i].ctl_name, route[i].strval);
-        } else {
-        ALOGV("Set '%s' to '%s'\n",
-             route[i].ctl_name, route[i].strval);
+    if (table->num_dev_cfgs > MAX_DEV_CFGS)
+        ALOGE("%d devices configured, only the first %d are used",
+              table->num_dev_cfgs, MAX_DEV_CFGS);
+}
+
+/* returns the set of the device configurations selected by the devices and use cases
+ * specified */
+static uint32_t select_dev_cfgs(struct route_table *table, int out_device, int in_device,
+                                uint32_t use_cases)
+{
+    uint32_t devices;
+    uint32_t cfgs = 0;
+    int i;
+
+    for (devices = (uint32_t)out_device; devices; devices &= devices - 1)
+        cfgs |= table->out_dev_cfgs[__builtin_ctz(devices)];
+    for (devices = (uint32_t)in_device & ~AUDIO_DEVICE_BIT_IN; devices; devices &= devices - 1)
+        cfgs |= table->in_dev_cfgs[__builtin_ctz(devices)];
+    for (i = 0; i < USE_CASE_CNT; i++) {
+        if (use_cases & USE_CASE_BIT(i))
+            cfgs |= table->use_case_cfgs[i];
+    }
+
+    return cfgs;
+}
+
+/* marks the entries of a path as providing the target value of their control, replacing
+ * any entry marked before */
+static void route_mark_targets(struct espresso_audio_device *adev,
+                               struct route_setting *route, unsigned int len)
+{
+    unsigned int i;
+    int id;
+
+    for (i = 0; i < len; i++) {
+        id = route_get_ctl(adev->mixer_shadow, &route[i]);
+        if (id >= 0)
+            adev->route_target[id] = &route[i];
+    }
+}
+
+/* marks the controls of a path as written by the transition */
+static void route_mark_touched(struct espresso_audio_device *adev,
+                               struct route_setting *route, unsigned int len)
+{
+    unsigned int i;
+    int id;
+
+    for (i = 0; i < len; i++) {
+        id = route_get_ctl(adev->mixer_shadow, &route[i]);
+        if (id >= 0)
+            adev->route_touched[id] = true;
+    }
+}
+
+/* appends the entries of a path that still provide the target value of their control to
+ * the plan if the transition writes the control, or only counts them if entries is NULL */
+static void route_add_targets(struct espresso_audio_device *adev, struct route_plan *plan,
+                              struct route_setting *route, unsigned int len)
+{
+    unsigned int i;
+    int id;
+
+    for (i = 0; i < len; i++) {
+        id = route_get_ctl(adev->mixer_shadow, &route[i]);
+        if (id < 0 || adev->route_target[id] != &route[i] || !adev->route_touched[id])
+            continue;
+        if (plan->entries)
+            plan->entries[plan->num_entries] = &route[i];
+        plan->num_entries++;
+    }
+}
+
+/* route_build_plan() merges the on paths of the device configurations selected and the off
+ * paths of the others into the list of control writes reaching that state. A control
+ * found in several paths takes the value of the last on path containing it, or of the
+ * last off path if no on path contains it.
+ * Only the controls of the configurations whose selection changes are written: the others
+ * keep their value, including the values set outside of the routes such as the PGAs. Such
+ * a control still takes the value of the paths of all the configurations, e.g. a device
+ * selected again after a use case overriding it is deselected.
+ * Must be called by the routing thread */
+static int route_build_plan(struct espresso_audio_device *adev, struct route_plan *plan,
+                            uint32_t from_cfgs, uint32_t cfgs)
+{
+    struct route_table *table = adev->route_table;
+    struct espresso_dev_cfg *cfg;
+    uint32_t changed = from_cfgs ^ cfgs;
+    unsigned int num_ctls = mixer_shadow_get_num_ctls(adev->mixer_shadow);
+    int pass;
+    int i;
+
+    memset(adev->route_target, 0, num_ctls * sizeof(*adev->route_target));
+    memset(adev->route_touched, 0, num_ctls * sizeof(*adev->route_touched));
+
+    for (i = 0; i < table->num_dev_cfgs && i < MAX_DEV_CFGS; i++) {
+        cfg = &table->dev_cfgs[i];
+        if (changed & (1u << i)) {
+            route_mark_touched(adev, cfg->on, cfg->on_len);
+            route_mark_touched(adev, cfg->off, cfg->off_len);
         }
+    }
 
-        } else {
-            /* This ensures multiple (i.e. stereo) values are set jointly */
-            for (j = 0; j < mixer_ctl_get_num_values(ctl); j++) {
-        ret = mixer_ctl_set_value(ctl, j, route[i].intval);
-        if (ret != 0) {
-            ALOGE("Failed to set '%s'.%d to %d\n",
-             route[i].ctl_name, j, route[i].intval);
-        } else {
-            ALOGV("Set '%s'.%d to %d\n",
-             route[i].ctl_name, j, route[i].intval);
+    for (i = 0; i < table->num_dev_cfgs && i < MAX_DEV_CFGS; i++) {
+        cfg = &table->dev_cfgs[i];
+        if (!(cfgs & (1u << i)))
+            route_mark_targets(adev, cfg->off, cfg->off_len);
+    }
+    for (i = 0; i < table->num_dev_cfgs && i < MAX_DEV_CFGS; i++) {
+        cfg = &table->dev_cfgs[i];
+        if (cfgs & (1u << i))
+            route_mark_targets(adev, cfg->on, cfg->on_len);
+    }
+
+    /* the entries are counted, then stored */
+    plan->from_cfgs = from_cfgs;
+    plan->cfgs = cfgs;
+    plan->entries = NULL;
+    for (pass = 0; pass < 2; pass++) {
+        plan->num_entries = 0;
+
+        /* Turn on new devices first so we don't glitch due to powerdown... */
+        for (i = 0; i < table->num_dev_cfgs && i < MAX_DEV_CFGS; i++) {
+            cfg = &table->dev_cfgs[i];
+            if (cfgs & (1u << i))
+                route_add_targets(adev, plan, cfg->on, cfg->on_len);
         }
+
+        /* ...then disable old ones. */
+        for (i = 0; i < table->num_dev_cfgs && i < MAX_DEV_CFGS; i++) {
+            cfg = &table->dev_cfgs[i];
+            if (!(cfgs & (1u << i)))
+                route_add_targets(adev, plan, cfg->off, cfg->off_len);
         }
+
+        if (pass == 0) {
+            plan->entries = calloc(plan->num_entries + 1, sizeof(*plan->entries));
+            if (!plan->entries)
+                return -ENOMEM;
         }
     }
 
     return 0;
 }
 
-/* Must be called with lock */
-void select_devices(struct espresso_audio_device *adev)
+/* returns the plan of the transition between the sets of device configurations specified,
+ * built the first time the transition happens with the route table installed.
+ * Must be called by the routing thread */
+static struct route_plan *route_get_plan(struct espresso_audio_device *adev,
+                                         uint32_t from_cfgs, uint32_t cfgs)
+{
+    struct route_table *table = adev->route_table;
+    struct route_plan *plan;
+    unsigned int i;
+
+    for (i = 0; i < table->num_plans; i++) {
+        if (table->plans[i].from_cfgs == from_cfgs && table->plans[i].cfgs == cfgs &&
+                table->plans[i].entries)
+            return &table->plans[i];
+    }
+
+    if (table->num_plans < ROUTE_PLAN_CACHE_SIZE) {
+        plan = &table->plans[table->num_plans++];
+    } else {
+        plan = &table->plans[table->next_plan];
+        table->next_plan = (table->next_plan + 1) % ROUTE_PLAN_CACHE_SIZE;
+        free(plan->entries);
+    }
+
+    /* a plan without entries is never looked up */
+    if (route_build_plan(adev, plan, from_cfgs, cfgs) != 0) {
+        ALOGE("%s: cannot build the route of configurations %08x -> %08x", __func__,
+              from_cfgs, cfgs);
+        return NULL;
+    }
+
+    ALOGV("%s: %u writes for configurations %08x -> %08x", __func__, plan->num_entries,
+          from_cfgs, cfgs);
+    return plan;
+}
+
+static struct route_table *route_table_create(void)
+{
+    struct route_table *table;
+
+    table = calloc(1, sizeof(struct route_table));
+    if (!table)
+        return NULL;
+    table->arena = arena_create(CONFIG_ARENA_CHUNK_SIZE);
+    if (!table->arena) {
+        free(table);
+        return NULL;
+    }
+
+    return table;
+}
+
+static void route_table_free(struct route_table *table)
+{
+    unsigned int i;
+
+    for (i = 0; i < table->num_plans; i++)
+        free(table->plans[i].entries);
+    free(table->dev_cfgs);
+    free(table->defaults);
+    if (table->cache)
+        route_cache_close(table->cache);
+    arena_destroy(table->arena);
+    free(table);
+}
+
+/* makes the routing use the table specified and applies its default paths, returns the
+ * table replaced. The first table installed also applies all the off paths, as the state
+ * of the controls is not known yet. A table parsed again after a change of the file starts
+ * from an unknown state too: the controls may have been changed while tuning it.
+ * Must be called by the routing thread */
+static struct route_table *route_install_table(struct espresso_audio_device *adev,
+                                               struct route_table *table)
 {
+    struct route_table *old = adev->route_table;
     int i;
 
-    if (adev->active_out_device == adev->out_device && adev->active_in_device == adev->in_device)
+    adev->route_table = table;
+    if (old)
+        mixer_shadow_invalidate(adev->mixer_shadow);
+
+    ALOGV("Applying %d element default route\n", table->defaults_len);
+    set_route_by_array(adev->mixer_shadow, table->defaults, table->defaults_len);
+
+    /* Apply them, we'll reenable anything that's wanted later */
+    if (!old) {
+        for (i = 0; i < table->num_dev_cfgs; i++)
+            set_route_by_array(adev->mixer_shadow, table->dev_cfgs[i].off,
+                               table->dev_cfgs[i].off_len);
+    }
+
+    return old;
+}
+
+/* apply_devices() moves the mixer from its current state to the one described by the on
+ * paths of the devices and use cases selected and the off paths of the others. The mixer
+ * shadow only writes the controls of the plan whose value changes. force applies the
+ * plan of all the configurations even if the devices did not change, after the route table
+ * was replaced.
+ * Must be called by the routing thread */
+static void apply_devices(struct espresso_audio_device *adev, int out_device, int in_device,
+                          uint32_t use_cases, bool force)
+{
+    struct route_plan *plan;
+    uint32_t cfgs;
+    int64_t start_ns;
+    unsigned int i;
+
+    if (!force && adev->active_out_device == out_device &&
+            adev->active_in_device == in_device && adev->active_use_cases == use_cases)
     return;
 
-    ALOGV("Changing output device %x => %x\n", adev->active_out_device, adev->out_device);
-    ALOGV("Changing input device %x => %x\n", adev->active_in_device, adev->in_device);
+    ALOGV("Changing output device %x => %x\n", adev->active_out_device, out_device);
+    ALOGV("Changing input device %x => %x\n", adev->active_in_device, in_device);
+    ALOGV("Changing use cases %x => %x\n", adev->active_use_cases, use_cases);
+    start_ns = route_time_ns();
+
+    cfgs = select_dev_cfgs(adev->route_table, out_device, in_device, use_cases);
+    plan = route_get_plan(adev, force ? ~cfgs : adev->active_cfgs, cfgs);
+    if (!plan)
+        return;
+
+    for (i = 0; i < plan->num_entries; i++)
+        set_route_entry(adev->mixer_shadow, plan->entries[i], 1);
+
+    route_stat(adev, ROUTE_STAGE_MIXER, adev->active_out_device, out_device, start_ns);
+    adev->active_out_device = out_device;
+    adev->active_in_device = in_device;
+    adev->active_use_cases = use_cases;
+    adev->active_cfgs = cfgs;
+}
+
+/* Must be called by the routing thread */
+static void set_input_volume(struct espresso_audio_device *adev, const char *name, int volume)
+{
+    int id;
+
+    id = mixer_shadow_find(adev->mixer_shadow, name);
+    if (id < 0) {
+        ALOGE("Unknown control '%s'\n", name);
+        return;
+    }
+
+    mixer_shadow_set_int(adev->mixer_shadow, id, volume);
+}
 
-    /* Turn on new devices first so we don't glitch due to powerdown... */
-    for (i = 0; i < adev->num_dev_cfgs; i++)
-    if ((adev->out_device & adev->dev_cfgs[i].mask) &&
-        !(adev->active_out_device & adev->dev_cfgs[i].mask))
-        set_route_by_array(adev->mixer, adev->dev_cfgs[i].on,
-                   adev->dev_cfgs[i].on_len);
+/* the routing thread applies the devices requested with the hw device mutex released:
+ * stream threads are never blocked by the mixer writes of a route change. It also installs
+ * the route tables parsed by the configuration watcher: the route in progress completes
+ * with the previous table, which is freed once the next one is installed. */
+static void *route_thread(void *context)
+{
+    struct espresso_audio_device *adev = (struct espresso_audio_device *)context;
+    struct route_table *table;
+    struct route_table *old;
+    uint32_t seq;
+    int out_device;
+    int in_device;
+    uint32_t use_cases;
+    int64_t request_ns;
+    int in_volumes[IN_PGA_CNT];
+    bool set_in_volumes;
+    int i;
 
-    for (i = 0; i < adev->num_dev_cfgs; i++)
-    if ((adev->in_device & adev->dev_cfgs[i].mask) &&
-        !(adev->active_in_device & adev->dev_cfgs[i].mask))
-        set_route_by_array(adev->mixer, adev->dev_cfgs[i].on,
-                   adev->dev_cfgs[i].on_len);
+    pthread_mutex_lock(&adev->route_lock);
+    while (!adev->route_exit) {
+        table = adev->route_next_table;
+        if (adev->route_applied == adev->route_requested && !table) {
+            pthread_cond_wait(&adev->route_cond, &adev->route_lock);
+            continue;
+        }
+        adev->route_next_table = NULL;
+        seq = adev->route_requested;
+        out_device = adev->route_out_device;
+        in_device = adev->route_in_device;
+        use_cases = adev->route_use_cases;
+        request_ns = adev->route_request_ns;
+        set_in_volumes = adev->route_in_volumes_pending;
+        adev->route_in_volumes_pending = false;
+        memcpy(in_volumes, adev->route_in_volumes, sizeof(in_volumes));
+        pthread_mutex_unlock(&adev->route_lock);
+
+        if (seq != adev->route_applied)
+            route_stat(adev, ROUTE_STAGE_QUEUE, adev->active_out_device, out_device,
+                       request_ns);
+
+        old = NULL;
+        if (table)
+            old = route_install_table(adev, table);
+        apply_devices(adev, out_device, in_device, use_cases, table != NULL);
+        /* after the route: the input paths may also set the PGAs */
+        for (i = 0; set_in_volumes && i < IN_PGA_CNT; i++)
+            set_input_volume(adev, in_pga_names[i], in_volumes[i]);
+
+        if (old)
+            route_table_free(old);
+
+        pthread_mutex_lock(&adev->route_lock);
+        adev->route_applied = seq;
+        pthread_cond_broadcast(&adev->route_cond);
+    }
+    pthread_mutex_unlock(&adev->route_lock);
 
-    /* ...then disable old ones. */
-    for (i = 0; i < adev->num_dev_cfgs; i++)
-    if (!(adev->out_device & adev->dev_cfgs[i].mask) &&
-        (adev->active_out_device & adev->dev_cfgs[i].mask))
-        set_route_by_array(adev->mixer, adev->dev_cfgs[i].off,
-                   adev->dev_cfgs[i].off_len);
+    return NULL;
+}
 
-    for (i = 0; i < adev->num_dev_cfgs; i++)
-    if (!(adev->in_device & adev->dev_cfgs[i].mask) &&
-        (adev->active_in_device & adev->dev_cfgs[i].mask))
-        set_route_by_array(adev->mixer, adev->dev_cfgs[i].off,
-                   adev->dev_cfgs[i].off_len);
+/* waits for the routing thread to apply the devices requested so far */
+static void route_wait(struct espresso_audio_device *adev)
+{
+    pthread_mutex_lock(&adev->route_lock);
+    while (adev->route_applied != adev->route_requested && !adev->route_exit)
+        pthread_cond_wait(&adev->route_cond, &adev->route_lock);
+    pthread_mutex_unlock(&adev->route_lock);
+}
 
-    adev->active_out_device = adev->out_device;
-    adev->active_in_device = adev->in_device;
+/* select_devices() requests the routing thread to apply adev->out_device, adev->in_device
+ * and adev->use_cases and returns without waiting. Requests not yet picked up by the
+ * thread are replaced: only the last devices selected are applied.
+ * Must be called with lock */
+void select_devices(struct espresso_audio_device *adev)
+{
+    pthread_mutex_lock(&adev->route_lock);
+    adev->route_out_device = adev->out_device;
+    adev->route_in_device = adev->in_device;
+    adev->route_use_cases = adev->use_cases;
+    adev->route_request_ns = route_time_ns();
+    adev->route_requested++;
+    pthread_cond_broadcast(&adev->route_cond);
+    pthread_mutex_unlock(&adev->route_lock);
 }
 
 static int start_call(struct espresso_audio_device *adev)
@@ -355,6 +887,9 @@ static int start_call(struct espresso_audio_device *adev)
     ALOGV("Opening modem PCMs");
     int bt_on;
 
+    /* the modem PCMs need the call route */
+    route_wait(adev);
+
     bt_on = adev->out_device & AUDIO_DEVICE_OUT_ALL_SCO;
     pcm_config_vx.rate = adev->wb_amr ? VX_WB_SAMPLING_RATE : VX_NB_SAMPLING_RATE;
 
@@ -475,9 +1010,12 @@ void audio_set_wb_amr_callback(void *data, int enable)
 
         /* reopen the modem PCMs at the new rate */
         if (adev->in_call) {
+            int64_t start_ns = route_time_ns();
+
             end_call(adev);
             set_eq_filter(adev);
             start_call(adev);
+            route_stat(adev, ROUTE_STAGE_PCM, adev->out_device, adev->out_device, start_ns);
         }
     }
     pthread_mutex_unlock(&adev->lock);
@@ -522,19 +1060,55 @@ static void set_incall_device(struct espresso_audio_device *adev)
     ril_set_call_audio_path(&adev->ril, device_type);
 }
 
+/* applies adev->in_gain_steps to the PGAs of the microphones turned on, the others are
+ * restored to 0 dB. The routing thread writes them after the devices requested so far,
+ * this does not wait.
+ * Must be called with lock */
 static void set_input_volumes(struct espresso_audio_device *adev, int main_mic_on,
                               int headset_mic_on, int sub_mic_on)
 {
+    int volume = MIN(IN_PGA_VOLUME_0DB + adev->in_gain_steps, IN_PGA_VOLUME_MAX);
+
+    volume = MAX(volume, 0);
+
+    pthread_mutex_lock(&adev->route_lock);
+    adev->route_in_volumes[IN_PGA_MAIN_MIC] = main_mic_on ? volume : IN_PGA_VOLUME_0DB;
+    adev->route_in_volumes[IN_PGA_HEADSET_MIC] = headset_mic_on ? volume : IN_PGA_VOLUME_0DB;
+    adev->route_in_volumes[IN_PGA_SUB_MIC] = sub_mic_on ? volume : IN_PGA_VOLUME_0DB;
+    adev->route_in_volumes_pending = true;
+    pthread_mutex_unlock(&adev->route_lock);
+
+    select_devices(adev);
 }
 
 static void set_output_volumes(struct espresso_audio_device *adev, bool tty_volume)
 {
 }
 
+/* opens or closes the debug tap of a stream after taps were toggled. Streams close their
+ * tap when entering standby so that each playback or capture gets its own file. */
+static struct tap *update_tap(struct espresso_audio_device *adev, struct tap *tap,
+                              const char *name, unsigned int rate, unsigned int channels)
+{
+    /* tap_writer is set before taps are enabled and never cleared */
+    bool enabled = android_atomic_acquire_load(&adev->tap_enabled) != 0;
+
+    if (enabled && tap == NULL)
+        return tap_open(adev->tap_writer, name, rate, channels);
+
+    if (!enabled && tap != NULL) {
+        tap_close(tap);
+        return NULL;
+    }
+
+    return tap;
+}
+
 static void force_all_standby(struct espresso_audio_device *adev)
 {
     struct espresso_stream_in *in;
     struct espresso_stream_out *out;
+    int i;
 
     /* only needed for low latency output streams as other streams are not used
      * for voice use cases */
@@ -546,20 +1120,109 @@ static void force_all_standby(struct espresso_audio_device *adev)
         pthread_mutex_unlock(&out->lock);
     }
 
-    if (adev->active_input) {
-        in = adev->active_input;
+    /* do_input_standby() removes the stream from the capture clients */
+    for (i = adev->capture.num_clients - 1; i >= 0; i--) {
+        in = adev->capture.clients[i];
         pthread_mutex_lock(&in->lock);
         do_input_standby(in);
         pthread_mutex_unlock(&in->lock);
     }
 }
 
+/* must be called with hw device mutex locked */
+static struct espresso_stream_in *get_voice_communication_input(struct espresso_audio_device *adev)
+{
+    int i;
+
+    for (i = 0; i < adev->capture.num_clients; i++) {
+        if (adev->capture.clients[i]->source == AUDIO_SOURCE_VOICE_COMMUNICATION)
+            return adev->capture.clients[i];
+    }
+    return NULL;
+}
+
+/* The analog PGA of the microphone is shared by all the clients of the capture PCM: it only
+ * takes the gain of a stream capturing alone outside of calls, other streams apply their
+ * whole gain digitally. The PGA gets the part of the gain that is a whole number of steps
+ * below it, the digital remainder is only an attenuation for gains below the PGA range.
+ * During calls the PGAs are set by the call use cases, whose off paths restore 0 dB.
+ * must be called with hw device mutex locked */
+static void capture_update_gains(struct espresso_audio_device *adev)
+{
+    struct espresso_capture *cap = &adev->capture;
+    struct espresso_stream_in *owner = NULL;
+    int main_mic_on = 0;
+    int headset_mic_on = 0;
+    int sub_mic_on = 0;
+    int steps = 0;
+    int i;
+
+    if (cap->num_clients == 1 && adev->mode != AUDIO_MODE_IN_CALL) {
+        owner = cap->clients[0];
+        main_mic_on = owner->device & AUDIO_DEVICE_IN_BUILTIN_MIC & ~AUDIO_DEVICE_BIT_IN;
+        headset_mic_on = owner->device & AUDIO_DEVICE_IN_WIRED_HEADSET & ~AUDIO_DEVICE_BIT_IN;
+        /* the sub mic is routed along with the main mic for beamforming, see
+         * capture_update_mic_mode(): both need the same gain */
+        sub_mic_on = main_mic_on && owner->beamformer;
+        if (main_mic_on || headset_mic_on) {
+            steps = (int)floorf(20.0f * log10f(owner->gain) / IN_PGA_STEP_DB);
+            steps = MIN(steps, IN_PGA_VOLUME_MAX - IN_PGA_VOLUME_0DB);
+            steps = MAX(steps, -IN_PGA_VOLUME_0DB);
+        }
+    }
+
+    for (i = 0; i < cap->num_clients; i++)
+        cap->clients[i]->analog_gain_steps = (cap->clients[i] == owner) ? steps : 0;
+
+    adev->in_gain_steps = steps;
+    if (adev->mode == AUDIO_MODE_IN_CALL)
+        return;
+
+    /* the shadow skips the PGAs already at the right volume */
+    set_input_volumes(adev, main_mic_on, headset_mic_on, sub_mic_on);
+}
+
+/* routes the sub mic to the right ADC channel while a beamforming client captures alone from
+ * the built-in mic outside of calls: other clients would get the sub mic in their right
+ * channel.
+ * must be called with hw device mutex locked */
+static void capture_update_mic_mode(struct espresso_audio_device *adev)
+{
+    struct espresso_capture *cap = &adev->capture;
+    bool dual_mic;
+
+    dual_mic = adev->mode != AUDIO_MODE_IN_CALL &&
+               (adev->in_device & AUDIO_DEVICE_IN_BUILTIN_MIC & ~AUDIO_DEVICE_BIT_IN) &&
+               cap->num_clients == 1 && cap->clients[0]->beamformer;
+
+    if (dual_mic == cap->dual_mic)
+        return;
+
+    ALOGV("%s: dual-mic capture %s", __func__, dual_mic ? "on" : "off");
+    if (dual_mic)
+        adev->use_cases |= USE_CASE_BIT(USE_CASE_DUAL_MIC_INPUT);
+    else
+        adev->use_cases &= ~USE_CASE_BIT(USE_CASE_DUAL_MIC_INPUT);
+    select_devices(adev);
+    /* the capture thread splits the channels once the sub mic is routed */
+    route_wait(adev);
+
+    pthread_mutex_lock(&cap->lock);
+    cap->dual_mic = dual_mic;
+    pthread_mutex_unlock(&cap->lock);
+}
+
 static void select_mode(struct espresso_audio_device *adev)
 {
+    int64_t start_ns = route_time_ns();
+    int64_t stage_ns;
+    int out_device = adev->out_device;
+
     if (adev->mode == AUDIO_MODE_IN_CALL) {
         ALOGE("Entering IN_CALL state, in_call=%d", adev->in_call);
         if (!adev->in_call) {
             force_all_standby(adev);
+            capture_stop_idle(adev);
             /* force earpiece route for in call state if speaker is the
             only currently selected route. This prevents having to tear
             down the modem PCMs to change route from speaker to earpiece
@@ -576,8 +1239,12 @@ static void select_mode(struct espresso_audio_device *adev)
             } else
                 adev->out_device &= ~AUDIO_DEVICE_OUT_SPEAKER;
             select_output_device(adev);
+            stage_ns = route_time_ns();
             start_call(adev);
+            route_stat(adev, ROUTE_STAGE_PCM, out_device, adev->out_device, stage_ns);
+            stage_ns = route_time_ns();
             ril_set_call_clock_sync(&adev->ril, SOUND_CLOCK_START);
+            route_stat(adev, ROUTE_STAGE_RIL, out_device, adev->out_device, stage_ns);
             adev_set_voice_volume(&adev->hw_device, adev->voice_volume);
             adev->in_call = 1;
         }
@@ -586,12 +1253,17 @@ static void select_mode(struct espresso_audio_device *adev)
              adev->in_call, adev->mode);
         if (adev->in_call) {
             adev->in_call = 0;
+            stage_ns = route_time_ns();
             end_call(adev);
+            route_stat(adev, ROUTE_STAGE_PCM, out_device, adev->out_device, stage_ns);
             force_all_standby(adev);
             select_output_device(adev);
             select_input_device(adev);
+            capture_start_preroll(adev);
         }
     }
+
+    route_stat(adev, ROUTE_STAGE_MODE, out_device, adev->out_device, start_ns);
 }
 
 static void select_output_device(struct espresso_audio_device *adev)
@@ -601,6 +1273,9 @@ static void select_output_device(struct espresso_audio_device *adev)
     int speaker_on;
     int earpiece_on;
     int bt_on;
+    uint32_t use_cases;
+    int64_t start_ns = route_time_ns();
+    int64_t stage_ns;
     bool tty_volume = false;
     unsigned int channel;
 
@@ -646,10 +1321,8 @@ static void select_output_device(struct espresso_audio_device *adev)
             break;
     }
 
-    select_devices(adev);
-
-	set_eq_filter(adev);
-
+    /* the call routes are applied by the routing thread with the devices */
+    use_cases = adev->use_cases & ~USE_CASES_CALL;
     if (adev->mode == AUDIO_MODE_IN_CALL) {
         if (!bt_on) {
             /* force tx path according to TTY mode when in call */
@@ -677,36 +1350,52 @@ static void select_output_device(struct espresso_audio_device *adev)
 
         if (headset_on || headphone_on || speaker_on || earpiece_on) {
             ALOGD("%s: set voicecall: voicecall_default", __func__);
-            set_bigroute_by_array(adev->mixer, voicecall_default, 1);
+            use_cases |= USE_CASE_BIT(USE_CASE_VOICECALL_DEFAULT);
         } else {
             ALOGD("%s: set voicecall: voicecall_default_disable", __func__);
-            set_bigroute_by_array(adev->mixer, voicecall_default_disable, 1);
+            use_cases |= USE_CASE_BIT(USE_CASE_VOICECALL_DEFAULT_DISABLE);
         }
 
         if (speaker_on || earpiece_on || headphone_on) {
             ALOGD("%s: set voicecall route: default_input", __func__);
-            set_bigroute_by_array(adev->mixer, default_input, 1);
+            use_cases |= USE_CASE_BIT(USE_CASE_DEFAULT_INPUT);
         } else {
             ALOGD("%s: set voicecall route: default_input_disable", __func__);
-            set_bigroute_by_array(adev->mixer, default_input_disable, 1);
+            use_cases |= USE_CASE_BIT(USE_CASE_DEFAULT_INPUT_DISABLE);
         }
 
         if (headset_on || headphone_on) {
             ALOGD("%s: set voicecall: headset_input", __func__);
-            set_bigroute_by_array(adev->mixer, headset_input, 1);
+            use_cases |= USE_CASE_BIT(USE_CASE_HEADSET_INPUT);
+        }
+
+        if (bt_on) {
+            ALOGD("%s: set voicecall: bt_input, bt_output", __func__);
+            use_cases |= USE_CASE_BIT(USE_CASE_BT_INPUT) | USE_CASE_BIT(USE_CASE_BT_OUTPUT);
         }
+    }
+    adev->use_cases = use_cases;
+
+    select_devices(adev);
+
+	set_eq_filter(adev);
 
+    if (adev->mode == AUDIO_MODE_IN_CALL) {
         if (bt_on) {
             // bt uses a different port (PORT_BT) for playback, reopen the pcms
+            stage_ns = route_time_ns();
             end_call(adev);
             start_call(adev);
-            ALOGD("%s: set voicecall: bt_input", __func__);
-            set_bigroute_by_array(adev->mixer, bt_input, 1);
-            ALOGD("%s: set voicecall: bt_output", __func__);
-            set_bigroute_by_array(adev->mixer, bt_output, 1);
+            route_stat(adev, ROUTE_STAGE_PCM, adev->stats_out_device, adev->out_device,
+                       stage_ns);
         }
+        stage_ns = route_time_ns();
         set_incall_device(adev);
+        route_stat(adev, ROUTE_STAGE_RIL, adev->stats_out_device, adev->out_device, stage_ns);
     }
+
+    route_stat(adev, ROUTE_STAGE_OUTPUT, adev->stats_out_device, adev->out_device, start_ns);
+    adev->stats_out_device = adev->out_device;
 }
 
 static void select_input_device(struct espresso_audio_device *adev)
@@ -740,6 +1429,7 @@ static int start_output_stream_low_latency(struct espresso_stream_out *out)
     if (adev->mode != AUDIO_MODE_IN_CALL) {
         select_output_device(adev);
     }
+    route_wait(adev);
 
     /* default to low power: will be corrected in out_write if necessary before first write to
      * tinyalsa.
@@ -794,6 +1484,7 @@ static int start_output_stream_deep_buffer(struct espresso_stream_out *out)
     if (adev->mode != AUDIO_MODE_IN_CALL) {
         select_output_device(adev);
     }
+    route_wait(adev);
 
     out->write_threshold = PLAYBACK_DEEP_BUFFER_LONG_PERIOD_COUNT * DEEP_BUFFER_LONG_PERIOD_SIZE;
     out->use_long_periods = true;
@@ -840,10 +1531,24 @@ static int check_input_parameters(uint32_t sample_rate, audio_format_t format, i
     return 0;
 }
 
-static size_t get_input_buffer_size(uint32_t sample_rate, audio_format_t format, int channel_count)
+/* returns the capture PCM configuration preferred for an audio source: voice communication
+ * uses short periods to keep latency low, other sources keep the default configuration.
+ * Both run at the playback rate, see VOIP_CAPTURE_PERIOD_SIZE. */
+static const struct pcm_config *get_capture_config(int source)
+{
+    switch (source) {
+    case AUDIO_SOURCE_VOICE_COMMUNICATION:
+        return &pcm_config_capture_voip;
+    default:
+        return &pcm_config_capture;
+    }
+}
+
+static size_t get_input_buffer_size(uint32_t sample_rate, audio_format_t format,
+                                    int channel_count, int source)
 {
+    const struct pcm_config *config = get_capture_config(source);
     size_t size;
-    size_t device_rate;
 
     if (check_input_parameters(sample_rate, format, channel_count) != 0)
         return 0;
@@ -851,7 +1556,7 @@ static size_t get_input_buffer_size(uint32_t sample_rate, audio_format_t format,
     /* take resampling into account and return the closest majoring
     multiple of 16 frames, as audioflinger expects audio buffers to
     be a multiple of 16 frames */
-    size = (pcm_config_capture.period_size * sample_rate) / pcm_config_capture.rate;
+    size = (config->period_size * sample_rate) / config->rate;
     size = ((size + 15) / 16) * 16;
 
     return size * channel_count * sizeof(short);
@@ -1025,6 +1730,11 @@ static int do_output_standby(struct espresso_stream_out *out)
             }
         }
 
+        if (out->tap != NULL) {
+            tap_close(out->tap);
+            out->tap = NULL;
+        }
+
         for (i = 0; i < OUTPUT_TOTAL; i++) {
             if (adev->outputs[i] != NULL && !adev->outputs[i]->standby) {
                 all_outputs_in_standby = false;
@@ -1095,8 +1805,7 @@ static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
              * handle duplication to HDMI or SPDIF */
             if (out == adev->outputs[OUTPUT_LOW_LATENCY] && !out->standby) {
                 /* a change in output device may change the microphone selection */
-                if (adev->active_input &&
-                        adev->active_input->source == AUDIO_SOURCE_VOICE_COMMUNICATION) {
+                if (get_voice_communication_input(adev) != NULL) {
                     force_input_standby = true;
                 }
                 /* force standby if moving to/from HDMI/SPDIF or if the output
@@ -1132,7 +1841,7 @@ static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
         }
         pthread_mutex_unlock(&out->lock);
         if (force_input_standby) {
-            in = adev->active_input;
+            in = get_voice_communication_input(adev);
             pthread_mutex_lock(&in->lock);
             do_input_standby(in);
             pthread_mutex_unlock(&in->lock);
@@ -1233,12 +1942,16 @@ static ssize_t out_write_low_latency(struct audio_stream_out *stream, const void
         }
         out->standby = 0;
         /* a change in output device may change the microphone selection */
-        if (adev->active_input &&
-                adev->active_input->source == AUDIO_SOURCE_VOICE_COMMUNICATION)
+        if (get_voice_communication_input(adev) != NULL)
             force_input_standby = true;
     }
     pthread_mutex_unlock(&adev->lock);
 
+    out->tap = update_tap(adev, out->tap, "out-low-latency",
+                          DEFAULT_OUT_SAMPLING_RATE, frame_size / sizeof(int16_t));
+    if (out->tap != NULL)
+        tap_write(out->tap, buffer, bytes);
+
     for (i = 0; i < PCM_TOTAL; i++) {
         /* only use resampler if required */
         if (out->pcm[i] && (out->config[i].rate != DEFAULT_OUT_SAMPLING_RATE)) {
@@ -1286,8 +1999,8 @@ exit:
 
     if (force_input_standby) {
         pthread_mutex_lock(&adev->lock);
-        if (adev->active_input) {
-            in = adev->active_input;
+        in = get_voice_communication_input(adev);
+        if (in) {
             pthread_mutex_lock(&in->lock);
             do_input_standby(in);
             pthread_mutex_unlock(&in->lock);
@@ -1325,9 +2038,14 @@ static ssize_t out_write_deep_buffer(struct audio_stream_out *stream, const void
         }
         out->standby = 0;
     }
-    use_long_periods = adev->screen_off && !adev->active_input;
+    use_long_periods = adev->screen_off && !adev->capture.num_clients;
     pthread_mutex_unlock(&adev->lock);
 
+    out->tap = update_tap(adev, out->tap, "out-deep-buffer",
+                          DEFAULT_OUT_SAMPLING_RATE, frame_size / sizeof(int16_t));
+    if (out->tap != NULL)
+        tap_write(out->tap, buffer, bytes);
+
     if (use_long_periods != out->use_long_periods) {
         size_t period_size;
         size_t period_count;
@@ -1408,60 +2126,678 @@ static int out_remove_audio_effect(const struct audio_stream *stream, effect_han
 
 /** audio_stream_in implementation **/
 
-/* must be called with hw device and input stream mutexes locked */
-static int start_input_stream(struct espresso_stream_in *in)
+static size_t in_frames_to_bytes(struct espresso_stream_in *in, size_t frames)
 {
-    int ret = 0;
-    struct espresso_audio_device *adev = in->dev;
+    return frames * in->config.channels * sizeof(int16_t);
+}
 
-    adev->active_input = in;
+/* must be called with capture mutex locked */
+static int capture_open_pcm(struct espresso_capture *cap, const struct pcm_config *config,
+                            unsigned int channels)
+{
+    size_t periods;
+    int i;
 
-    if (adev->mode != AUDIO_MODE_IN_CALL) {
-        adev->in_device = in->device;
-        select_input_device(adev);
+    cap->config = *config;
+    cap->config.channels = channels;
+
+    /* the callers wait for the input route with route_wait() */
+    cap->pcm = pcm_open(CARD_DEFAULT, PORT_CAPTURE, PCM_IN, &cap->config);
+    if (!pcm_is_ready(cap->pcm)) {
+        ALOGE("cannot open pcm_in driver: %s", pcm_get_error(cap->pcm));
+        pcm_close(cap->pcm);
+        cap->pcm = NULL;
+        return -ENOMEM;
+    }
+
+    /* the ring is a whole number of periods so that a period is always read contiguously,
+     * it also holds the pre-roll history */
+    periods = (cap->config.rate * (CAPTURE_RING_MS + cap->preroll_ms) / 1000 +
+                  cap->config.period_size - 1) / cap->config.period_size;
+    cap->ring_frames = cap->config.period_size * MAX(periods, CAPTURE_RING_MIN_PERIODS);
+    cap->ring = (int16_t *)realloc(cap->ring,
+                                   cap->ring_frames * channels * sizeof(int16_t));
+    ALOG_ASSERT((cap->ring != NULL), "%s failed to reallocate ring", __func__);
+    /* the beamformer reads a few frames before the first one captured */
+    memset(cap->ring, 0, cap->ring_frames * channels * sizeof(int16_t));
+
+    /* frames buffered with the previous channel layout are lost */
+    cap->frames_written = 0;
+    cap->read_tstamp_valid = false;
+    for (i = 0; i < cap->num_clients; i++)
+        cap->clients[i]->capture_pos = 0;
+
+    ALOGV("%s: capture PCM opened at %u Hz with %u channels, period %u, ring of %d frames",
+          __func__, cap->config.rate, channels, cap->config.period_size, cap->ring_frames);
+    return 0;
+}
+
+/* returns the number of frames captured before the client started that it should read
+ * first. Voice communication does not use the pre-roll: the history would add to the
+ * latency of the call for its whole duration.
+ * must be called with capture mutex locked */
+static size_t capture_history_frames(struct espresso_capture *cap, struct espresso_stream_in *in)
+{
+    uint64_t frames;
+
+    if (cap->preroll_ms == 0 || in->source == AUDIO_SOURCE_VOICE_COMMUNICATION)
+        return 0;
+
+    frames = (uint64_t)cap->config.rate * cap->preroll_ms / 1000;
+    /* leave one period of slack so that the first read does not overrun the history */
+    frames = MIN(frames, cap->ring_frames - cap->config.period_size);
+    frames = MIN(frames, cap->frames_written);
+    return (size_t)frames;
+}
+
+/* waits for the period being read to be published before the PCM or the ring is changed.
+ * must be called with capture mutex locked */
+static void capture_wait_read(struct espresso_capture *cap)
+{
+    while (cap->reading)
+        pthread_cond_wait(&cap->read_cond, &cap->lock);
+}
+
+/* reads a period from the kernel driver into the ring without holding the capture mutex,
+ * so that other clients can copy the frames already captured meanwhile. If another thread
+ * is reading, waits for its period instead.
+ * must be called with capture mutex locked */
+static int capture_read_period(struct espresso_capture *cap)
+{
+    struct pcm *pcm = cap->pcm;
+    int16_t *period;
+    int ret;
+
+    if (cap->reading) {
+        capture_wait_read(cap);
+        return 0;
+    }
+
+    period = cap->ring + (cap->frames_written % cap->ring_frames) * cap->config.channels;
+    cap->reading = true;
+    pthread_mutex_unlock(&cap->lock);
+
+    ret = pcm_read(pcm, period, pcm_frames_to_bytes(pcm, cap->config.period_size));
+
+    pthread_mutex_lock(&cap->lock);
+    cap->reading = false;
+    if (ret == 0) {
+        cap->frames_written += cap->config.period_size;
+        cap->read_tstamp_valid = pcm_get_htimestamp(pcm, &cap->read_avail,
+                                                    &cap->read_tstamp) == 0;
+    }
+    pthread_cond_broadcast(&cap->read_cond);
+
+    return ret;
+}
+
+/* The first client opens the capture PCM with the configuration preferred by its audio
+ * source, later clients adopt the rate and period size of the running PCM and resample.
+ * must be called with hw device and input stream mutexes locked */
+static int capture_add_client(struct espresso_audio_device *adev, struct espresso_stream_in *in)
+{
+    struct espresso_capture *cap = &adev->capture;
+    unsigned int channels = MAX(in->config.channels, pcm_config_capture.channels);
+    const struct pcm_config *config = get_capture_config(in->source);
+    struct pcm_config running;
+    int ret = 0;
+
+    pthread_mutex_lock(&cap->lock);
+    capture_wait_read(cap);
+    if (cap->num_clients >= MAX_CAPTURE_CLIENTS) {
+        ALOGE("%s: too many capture clients", __func__);
+        ret = -EBUSY;
+        goto exit;
+    }
+
+    /* a PCM kept open in warm standby is reopened if this client prefers another
+     * configuration, the pre-roll PCM is kept for its history */
+    if (cap->pcm != NULL && cap->num_clients == 0 && cap->preroll_ms == 0 &&
+            (cap->config.rate != config->rate ||
+             cap->config.period_size != config->period_size)) {
+        ALOGV("%s: reopening warm capture PCM at %u Hz", __func__, config->rate);
+        pcm_close(cap->pcm);
+        cap->pcm = NULL;
+    }
+
+    /* clients extract their channels from the shared PCM: reopen it if it
+     * delivers fewer channels than this client needs */
+    if (cap->pcm != NULL && channels > cap->config.channels) {
+        ALOGV("%s: reopening capture PCM for %u channels", __func__, channels);
+        pcm_close(cap->pcm);
+        cap->pcm = NULL;
+        running = cap->config;
+        config = &running;
+    }
+
+    if (cap->pcm == NULL) {
+        ret = capture_open_pcm(cap, config, channels);
+        if (ret != 0)
+            goto exit;
+    }
+
+    in->config.rate = cap->config.rate;
+    in->config.period_size = cap->config.period_size;
+    in->config.period_count = cap->config.period_count;
+    in->capture_pos = cap->frames_written - capture_history_frames(cap, in);
+    cap->clients[cap->num_clients++] = in;
+
+exit:
+    pthread_mutex_unlock(&cap->lock);
+    return ret;
+}
+
+/* must be called with hw device and input stream mutexes locked.
+ * Returns the number of clients still capturing. */
+static int capture_remove_client(struct espresso_audio_device *adev, struct espresso_stream_in *in)
+{
+    struct espresso_capture *cap = &adev->capture;
+    int i;
+
+    pthread_mutex_lock(&cap->lock);
+    for (i = 0; i < cap->num_clients; i++) {
+        if (cap->clients[i] == in) {
+            memmove(&cap->clients[i], &cap->clients[i + 1],
+                    (cap->num_clients - i - 1) * sizeof(cap->clients[0]));
+            cap->num_clients--;
+            break;
+        }
+    }
+
+    if (cap->num_clients == 0 && cap->pcm != NULL) {
+        capture_wait_read(cap);
+        if (cap->idle_running && !cap->idle_exit) {
+            /* hand the PCM over to the idle thread */
+            struct timespec now;
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            cap->idle_since_ns = timespec_to_ns(&now);
+            pthread_cond_signal(&cap->idle_cond);
+        } else {
+            pcm_close(cap->pcm);
+            cap->pcm = NULL;
+        }
+    }
+    pthread_mutex_unlock(&cap->lock);
+
+    return cap->num_clients;
+}
+
+/* must be called with capture mutex locked */
+static bool capture_warm_standby_expired(struct espresso_capture *cap)
+{
+    struct timespec now;
+
+    if (cap->preroll_ms != 0)
+        return false;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return timespec_to_ns(&now) - cap->idle_since_ns >=
+               (int64_t)cap->warm_standby_ms * 1000000;
+}
+
+/* closes the PCM and turns the microphone off at the end of the warm standby. The hw device
+ * mutex is only tried: capture_stop_idle() holds it while waiting for this thread, and
+ * signals idle_cond so that the retry wait ends at once.
+ * Called by the idle thread with capture mutex locked, returns with it locked. Returns true
+ * if the PCM was closed. */
+static bool capture_idle_teardown(struct espresso_audio_device *adev)
+{
+    struct espresso_capture *cap = &adev->capture;
+    struct timespec ts;
+    bool closed = false;
+
+    while (pthread_mutex_trylock(&adev->lock) != 0) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += CAPTURE_IDLE_RETRY_MS * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_nsec -= 1000000000;
+            ts.tv_sec++;
+        }
+        pthread_cond_timedwait(&cap->idle_cond, &cap->lock, &ts);
+        if (cap->idle_exit || cap->num_clients > 0)
+            return false;
+    }
+    pthread_mutex_unlock(&cap->lock);
+
+    pthread_mutex_lock(&cap->lock);
+    capture_wait_read(cap);
+    if (!cap->idle_exit && cap->num_clients == 0 && cap->pcm != NULL &&
+            capture_warm_standby_expired(cap)) {
+        pcm_close(cap->pcm);
+        cap->pcm = NULL;
+        closed = true;
+    }
+    pthread_mutex_unlock(&cap->lock);
+
+    if (closed && adev->mode != AUDIO_MODE_IN_CALL) {
+        ALOGV("%s: end of capture warm standby", __func__);
+        adev->in_device = AUDIO_DEVICE_NONE;
+        select_input_device(adev);
+    }
+    pthread_mutex_unlock(&adev->lock);
+
+    pthread_mutex_lock(&cap->lock);
+    return closed;
+}
+
+/* reads the capture PCM into the ring while no client does it. The thread ends with the warm
+ * standby: it sets idle_exit and is joined by the next capture_start_idle_thread() or
+ * capture_stop_idle(). */
+static void *capture_idle_thread(void *context)
+{
+    struct espresso_audio_device *adev = (struct espresso_audio_device *)context;
+    struct espresso_capture *cap = &adev->capture;
+    int ret;
+
+    pthread_mutex_lock(&cap->lock);
+    while (!cap->idle_exit) {
+        if (cap->num_clients > 0 || cap->pcm == NULL) {
+            pthread_cond_wait(&cap->idle_cond, &cap->lock);
+            continue;
+        }
+
+        if (capture_warm_standby_expired(cap)) {
+            if (capture_idle_teardown(adev))
+                cap->idle_exit = true;
+            continue;
+        }
+
+        ret = capture_read_period(cap);
+        if (ret != 0) {
+            ALOGE("%s: pcm_read error %d", __func__, ret);
+            pthread_mutex_unlock(&cap->lock);
+            usleep(cap->config.period_size * 1000000 / cap->config.rate);
+            pthread_mutex_lock(&cap->lock);
+        }
+    }
+    pthread_mutex_unlock(&cap->lock);
+
+    return NULL;
+}
+
+/* must be called with hw device and capture mutexes locked */
+static int capture_start_idle_thread(struct espresso_audio_device *adev)
+{
+    struct espresso_capture *cap = &adev->capture;
+
+    if (cap->idle_running && !cap->idle_exit)
+        return 0;
+
+    /* the previous thread ended or is ending, it does not need the capture mutex anymore */
+    if (cap->idle_running) {
+        pthread_join(cap->idle_thread, NULL);
+        cap->idle_running = false;
+    }
+
+    cap->idle_exit = false;
+    if (pthread_create(&cap->idle_thread, NULL, capture_idle_thread, adev) != 0) {
+        ALOGE("%s: cannot create capture idle thread", __func__);
+        return -ENOMEM;
+    }
+    cap->idle_running = true;
+    return 0;
+}
+
+/* keeps the PCM and the route of the last client open after it stops.
+ * must be called with hw device mutex locked, before removing the last client */
+static void capture_start_warm_standby(struct espresso_audio_device *adev)
+{
+    struct espresso_capture *cap = &adev->capture;
+
+    if (cap->warm_standby_ms == 0 || adev->mode == AUDIO_MODE_IN_CALL)
+        return;
+
+    pthread_mutex_lock(&cap->lock);
+    capture_start_idle_thread(adev);
+    pthread_mutex_unlock(&cap->lock);
+}
+
+/* opens the capture PCM if no client uses it and starts the idle thread filling the ring.
+ * must be called with hw device mutex locked */
+static void capture_start_preroll(struct espresso_audio_device *adev)
+{
+    struct espresso_capture *cap = &adev->capture;
+
+    if (cap->preroll_ms == 0 || adev->mode == AUDIO_MODE_IN_CALL)
+        return;
+
+    if (adev->capture.num_clients == 0) {
+        if (adev->in_device == AUDIO_DEVICE_NONE)
+            adev->in_device = AUDIO_DEVICE_IN_BUILTIN_MIC & ~AUDIO_DEVICE_BIT_IN;
+        select_input_device(adev);
+    }
+    route_wait(adev);
+
+    pthread_mutex_lock(&cap->lock);
+    if (cap->pcm == NULL &&
+            capture_open_pcm(cap, &pcm_config_capture,
+                             pcm_config_capture.channels) != 0) {
+        pthread_mutex_unlock(&cap->lock);
+        return;
+    }
+
+    if (capture_start_idle_thread(adev) != 0 && cap->num_clients == 0) {
+        pcm_close(cap->pcm);
+        cap->pcm = NULL;
+    }
+    pthread_mutex_unlock(&cap->lock);
+
+    ALOGV("%s: %u ms capture pre-roll", __func__, cap->preroll_ms);
+}
+
+/* stops the idle thread, closes the capture PCM and turns the microphone off if no client
+ * uses them.
+ * must be called with hw device mutex locked */
+static void capture_stop_idle(struct espresso_audio_device *adev)
+{
+    struct espresso_capture *cap = &adev->capture;
+
+    pthread_mutex_lock(&cap->lock);
+    if (!cap->idle_running) {
+        pthread_mutex_unlock(&cap->lock);
+        return;
+    }
+    cap->idle_exit = true;
+    pthread_cond_signal(&cap->idle_cond);
+    pthread_mutex_unlock(&cap->lock);
+
+    pthread_join(cap->idle_thread, NULL);
+
+    pthread_mutex_lock(&cap->lock);
+    cap->idle_running = false;
+    capture_wait_read(cap);
+    if (cap->num_clients == 0 && cap->pcm != NULL) {
+        pcm_close(cap->pcm);
+        cap->pcm = NULL;
+    }
+    pthread_mutex_unlock(&cap->lock);
+
+    if (adev->capture.num_clients == 0 && adev->mode != AUDIO_MODE_IN_CALL) {
+        adev->in_device = AUDIO_DEVICE_NONE;
+        select_input_device(adev);
+    }
+}
+
+/* returns the position of the oldest frame that can be read along with the history frames
+ * before it: the period being read by another thread overwrites the oldest frames. Before
+ * the first frame captured the ring holds zeros until the ring wraps.
+ * must be called with capture mutex locked */
+static uint64_t capture_oldest_frame(struct espresso_capture *cap, size_t history)
+{
+    uint64_t end = cap->frames_written + (cap->reading ? cap->config.period_size : 0) +
+                       history;
+
+    return end > cap->ring_frames ? end - cap->ring_frames : 0;
+}
+
+/* makes frames available in the ring for the client: a new period is read from the kernel
+ * driver only when the client has consumed everything buffered in the ring.
+ * must be called with capture mutex locked */
+static int capture_fill(struct espresso_capture *cap, struct espresso_stream_in *in)
+{
+    uint64_t oldest;
+    int ret;
+
+    if (cap->pcm == NULL)
+        return -ENODEV;
+
+    if (in->capture_pos == cap->frames_written) {
+        ret = capture_read_period(cap);
+        if (ret != 0) {
+            ALOGE("%s: pcm_read error %d", __func__, ret);
+            return ret;
+        }
+    }
+
+    /* this client did not read for a while and the others overwrote its frames. The
+     * beamformer also needs the frames of its steering delay before them. */
+    oldest = capture_oldest_frame(cap, in->beamformer && cap->dual_mic ?
+                                           in->beamformer_delay : 0);
+    if (in->capture_pos < oldest) {
+        in->frames_lost += oldest - in->capture_pos;
+        in->capture_pos = oldest;
+    }
+
+    return 0;
+}
+
+/* capture_read() copies frames captured by the shared PCM to the buffer specified, in the
+ * channel layout of the client.
+ * Mono clients get the left channel: all input routes feed both AIF1 ADC channels from
+ * the same microphone, or the main mic on the left channel in dual-mic mode, so this
+ * selects a single mic without a downmix.
+ * Beamforming clients get the main mic summed with the sub mic delayed by their steering
+ * delay in all their channels when the dual-mic route is active, see
+ * capture_update_mic_mode().
+ * must be called with input stream mutex locked */
+static int capture_read(struct espresso_capture *cap, struct espresso_stream_in *in,
+                        int16_t *buffer, size_t frames)
+{
+    int16_t *start = buffer;
+    int ret = 0;
+
+    pthread_mutex_lock(&cap->lock);
+    while (frames > 0) {
+        size_t offset;
+        size_t count;
+
+        ret = capture_fill(cap, in);
+        if (ret != 0)
+            break;
+
+        offset = in->capture_pos % cap->ring_frames;
+        count = MIN(frames, (size_t)(cap->frames_written - in->capture_pos));
+        count = MIN(count, cap->ring_frames - offset);
+
+        if (in->beamformer && cap->dual_mic) {
+            size_t delayed = (in->capture_pos + cap->ring_frames - in->beamformer_delay) %
+                                 cap->ring_frames;
+
+            count = MIN(count, cap->ring_frames - delayed);
+            dsp_delay_and_sum(buffer, in->config.channels,
+                              cap->ring + offset * cap->config.channels,
+                              cap->ring + delayed * cap->config.channels,
+                              cap->config.channels, count);
+        } else {
+            dsp_extract_channels(buffer, in->config.channels,
+                                 cap->ring + offset * cap->config.channels,
+                                 cap->config.channels, count);
+        }
+        buffer += count * in->config.channels;
+        in->capture_pos += count;
+        frames -= count;
+    }
+    pthread_mutex_unlock(&cap->lock);
+
+    /* before the resampler and the pre processings: the AGC must not see the offset */
+    if (in->dc_block)
+        dsp_dc_block(&in->dc_blocker, start, in->config.channels,
+                     (buffer - start) / in->config.channels);
+
+    return ret;
+}
+
+/* capture_skip() consumes frames like capture_read() without copying them: the PCM is
+ * drained and the client keeps its timing while its audio is discarded.
+ * must be called with input stream mutex locked */
+static int capture_skip(struct espresso_capture *cap, struct espresso_stream_in *in,
+                        size_t frames)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&cap->lock);
+    while (frames > 0) {
+        size_t count;
+
+        ret = capture_fill(cap, in);
+        if (ret != 0)
+            break;
+
+        count = MIN(frames, (size_t)(cap->frames_written - in->capture_pos));
+        in->capture_pos += count;
+        frames -= count;
+    }
+    pthread_mutex_unlock(&cap->lock);
+
+    return ret;
+}
+
+/* returns the frames pending in the kernel driver plus the frames already captured
+ * by the shared PCM that the client has not read yet.
+ * The driver is not queried while another client is reading: the frames it returns
+ * would be counted before frames_written includes them. The timestamp taken when the
+ * last period was published is used instead, so that the position never goes back.
+ * must be called with input stream mutex locked */
+static int capture_get_htimestamp(struct espresso_capture *cap, struct espresso_stream_in *in,
+                                  size_t *frames, struct timespec *tstamp)
+{
+    unsigned int kernel_frames;
+    int ret = -ENODEV;
+
+    pthread_mutex_lock(&cap->lock);
+    if (cap->pcm != NULL) {
+        if (cap->read_tstamp_valid) {
+            kernel_frames = cap->read_avail;
+            *tstamp = cap->read_tstamp;
+            ret = 0;
+        } else {
+            /* nothing published yet: wait for the first period rather than racing it */
+            capture_wait_read(cap);
+            if (cap->pcm != NULL)
+                ret = pcm_get_htimestamp(cap->pcm, &kernel_frames, tstamp);
+        }
+        if (ret == 0)
+            *frames = kernel_frames + (size_t)(cap->frames_written - in->capture_pos);
+    }
+    pthread_mutex_unlock(&cap->lock);
+
+    return ret;
+}
+
+/* voice recognition and VoIP are band limited to 8 kHz at most and run for long periods:
+ * the cheapest quality is transparent for them. Camcorder recordings are kept at full
+ * bandwidth. */
+static int in_get_resampler_quality(struct espresso_stream_in *in)
+{
+    if (in->resampler_quality_override >= 0)
+        return in->resampler_quality_override;
+
+    switch (in->source) {
+    case AUDIO_SOURCE_VOICE_RECOGNITION:
+    case AUDIO_SOURCE_VOICE_COMMUNICATION:
+        return RESAMPLER_QUALITY_VOIP;
+    case AUDIO_SOURCE_CAMCORDER:
+        return RESAMPLER_QUALITY_DESKTOP;
+    default:
+        return RESAMPLER_QUALITY_DEFAULT;
+    }
+}
+
+/* (re)creates the resampler converting from the capture rate to the rate requested by the
+ * client with the quality chosen for the audio source, releases it if both rates are equal.
+ * must be called with input stream mutex locked */
+static int in_configure_resampler(struct espresso_stream_in *in)
+{
+    int ret;
+
+    in->resampler_quality = in_get_resampler_quality(in);
+
+    if (in->resampler) {
+        release_resampler(in->resampler);
+        in->resampler = NULL;
+    }
+
+    if (in->requested_rate == in->config.rate)
+        return 0;
+
+    in->buf_provider.get_next_buffer = get_next_buffer;
+    in->buf_provider.release_buffer = release_buffer;
+
+    ret = create_resampler(in->config.rate,
+                           in->requested_rate,
+                           in->config.channels,
+                           in->resampler_quality,
+                           &in->buf_provider,
+                           &in->resampler);
+    if (ret != 0) {
+        ALOGE("%s: cannot create resampler %u -> %u Hz: %d",
+              __func__, in->config.rate, in->requested_rate, ret);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+/* must be called with hw device and input stream mutexes locked */
+static int start_input_stream(struct espresso_stream_in *in)
+{
+    int ret = 0;
+    struct espresso_audio_device *adev = in->dev;
+    unsigned int rate = in->config.rate;
+    bool reconfigure = false;
+
+    if (adev->mode != AUDIO_MODE_IN_CALL) {
+        adev->in_device = in->device;
+        select_input_device(adev);
     }
 
     if (in->aux_channels_changed)
     {
         in->aux_channels_changed = false;
         in->config.channels = popcount(in->main_channels | in->aux_channels);
-
-        if (in->resampler) {
-            /* release and recreate the resampler with the new number of channel of the input */
-            release_resampler(in->resampler);
-            in->resampler = NULL;
-            ret = create_resampler(in->config.rate,
-                               in->requested_rate,
-                               in->config.channels,
-                               RESAMPLER_QUALITY_DEFAULT,
-                               &in->buf_provider,
-                               &in->resampler);
-        }
+        reconfigure = true;
         ALOGV("%s: New channel configuration, "
                 "main_channels = [%04x], aux_channels = [%04x], config.channels = %d",
                 __func__, in->main_channels, in->aux_channels, in->config.channels);
     }
 
-    if (in->need_echo_reference && in->echo_reference == NULL)
-        in->echo_reference = get_echo_reference(adev,
-                                        AUDIO_FORMAT_PCM_16_BIT,
-                                        popcount(in->main_channels),
-                                        in->requested_rate);
+    /* there is only one echo reference: the first input needing it keeps it */
+    if (in->need_echo_reference && in->echo_reference == NULL) {
+        if (adev->echo_reference != NULL)
+            ALOGW("%s: echo reference already used by another input", __func__);
+        else
+            in->echo_reference = get_echo_reference(adev,
+                                            AUDIO_FORMAT_PCM_16_BIT,
+                                            popcount(in->main_channels),
+                                            in->requested_rate);
+    }
 
-    /* this assumes routing is done previously */
-    in->pcm = pcm_open(CARD_DEFAULT, PORT_CAPTURE, PCM_IN, &in->config);
-    if (!pcm_is_ready(in->pcm)) {
-        ALOGE("cannot open pcm_in driver: %s", pcm_get_error(in->pcm));
-        pcm_close(in->pcm);
-        adev->active_input = NULL;
-        return -ENOMEM;
+    /* the codec high-pass filter is only enabled on the built-in mic route */
+    in->dc_block = adev->mode != AUDIO_MODE_IN_CALL && (adev->in_device & adev->dc_block_devices);
+
+    /* the capture rate depends on the audio source and on the other clients */
+    route_wait(adev);
+    ret = capture_add_client(adev, in);
+    if (ret == 0 && (reconfigure || in->config.rate != rate ||
+                     in->resampler_quality != in_get_resampler_quality(in))) {
+        ret = in_configure_resampler(in);
+        if (ret != 0)
+            capture_remove_client(adev, in);
     }
+    if (ret == 0 && in->dc_block)
+        dsp_dc_blocker_init(&in->dc_blocker, in->config.rate, DC_BLOCK_CUTOFF_HZ);
+    if (ret != 0) {
+        if (in->echo_reference != NULL) {
+            put_echo_reference(adev, in->echo_reference);
+            in->echo_reference = NULL;
+        }
+        return ret;
+    }
+
+    capture_update_gains(adev);
+    capture_update_mic_mode(adev);
 
-    /* force read and proc buf reallocation case of frame size or channel count change */
+    /* buffers are only reallocated if the frame size changed, they grow with the period */
+    if (reconfigure) {
+        in->read_buf_size = 0;
+        in->proc_buf_size = 0;
+    }
     in->read_buf_frames = 0;
-    in->read_buf_size = 0;
     in->proc_buf_frames = 0;
-    in->proc_buf_size = 0;
+    in->frames_read = 0;
+    /* in_read() applies the current mute state */
+    in->muted = false;
     /* if no supported sample rate is available, use the resampler */
     if (in->resampler) {
         in->resampler->reset(in->resampler);
@@ -1487,14 +2823,15 @@ static size_t in_get_buffer_size(const struct audio_stream *stream)
 
     return get_input_buffer_size(in->requested_rate,
                                  AUDIO_FORMAT_PCM_16_BIT,
-                                 popcount(in->main_channels));
+                                 popcount(in->main_channels),
+                                 in->source);
 }
 
 static audio_channel_mask_t in_get_channels(const struct audio_stream *stream)
 {
     struct espresso_stream_in *in = (struct espresso_stream_in *)stream;
 
-    return AUDIO_CHANNEL_IN_STEREO;
+    return in->main_channels;
 }
 
 static audio_format_t in_get_format(const struct audio_stream *stream)
@@ -1511,16 +2848,29 @@ static int in_set_format(struct audio_stream *stream, audio_format_t format)
 static int do_input_standby(struct espresso_stream_in *in)
 {
     struct espresso_audio_device *adev = in->dev;
+    int remaining;
 
     if (!in->standby) {
-        pcm_close(in->pcm);
-        in->pcm = NULL;
+        if (adev->capture.num_clients == 1)
+            capture_start_warm_standby(adev);
+        remaining = capture_remove_client(adev, in);
 
-        adev->active_input = 0;
         if (adev->mode != AUDIO_MODE_IN_CALL) {
-            adev->in_device = AUDIO_DEVICE_NONE;
+            /* keep the microphone of the most recently started remaining input,
+             * the idle thread keeps capturing from the last one used */
+            if (remaining > 0)
+                adev->in_device = adev->capture.clients[remaining - 1]->device;
+            else if (!adev->capture.idle_running || adev->capture.idle_exit)
+                adev->in_device = AUDIO_DEVICE_NONE;
             select_input_device(adev);
         }
+        capture_update_gains(adev);
+        capture_update_mic_mode(adev);
+
+        if (in->tap != NULL) {
+            tap_close(in->tap);
+            in->tap = NULL;
+        }
 
         if (in->echo_reference != NULL) {
             /* stop reading from echo reference */
@@ -1528,6 +2878,9 @@ static int do_input_standby(struct espresso_stream_in *in)
             put_echo_reference(adev, in->echo_reference);
             in->echo_reference = NULL;
         }
+        /* the next echo reference may come from another output with another delay */
+        if (in->echo_delay != NULL)
+            echo_delay_reset(in->echo_delay);
 
         in->standby = 1;
     }
@@ -1549,6 +2902,28 @@ static int in_standby(struct audio_stream *stream)
 
 static int in_dump(const struct audio_stream *stream, int fd)
 {
+    struct espresso_stream_in *in = (struct espresso_stream_in *)stream;
+    char buffer[256];
+    int i;
+
+    pthread_mutex_lock(&in->lock);
+    for (i = 0; i < in->num_preprocessors; i++) {
+        struct effect_info_s *fx = &in->preprocessors[i];
+
+        snprintf(buffer, sizeof(buffer),
+                 "  preprocessor %d: %s, %u calls, %llu us average\n",
+                 i, fx->bypassed ? "bypassed" : "active", fx->process_count,
+                 fx->process_count ?
+                        (unsigned long long)(fx->process_ns / fx->process_count / 1000) : 0);
+        write(fd, buffer, strlen(buffer));
+    }
+    if (in->echo_delay != NULL) {
+        snprintf(buffer, sizeof(buffer), "  echo delay correction: %d us\n",
+                 echo_delay_get_us(in->echo_delay));
+        write(fd, buffer, strlen(buffer));
+    }
+    pthread_mutex_unlock(&in->lock);
+
     return 0;
 }
 
@@ -1560,6 +2935,7 @@ static int in_set_parameters(struct audio_stream *stream, const char *kvpairs)
     char *str;
     char value[32];
     int ret, val = 0;
+    int status = 0;
     bool do_standby = false;
 
     parms = str_parms_create_str(kvpairs);
@@ -1589,32 +2965,179 @@ static int in_set_parameters(struct audio_stream *stream, const char *kvpairs)
         }
     }
 
+    /* applied when the stream leaves standby */
+    ret = str_parms_get_str(parms, AUDIO_PARAMETER_STREAM_RESAMPLER_QUALITY, value, sizeof(value));
+    if (ret >= 0) {
+        if (strcmp(value, "low") == 0)
+            val = RESAMPLER_QUALITY_VOIP;
+        else if (strcmp(value, "default") == 0)
+            val = RESAMPLER_QUALITY_DEFAULT;
+        else if (strcmp(value, "high") == 0)
+            val = RESAMPLER_QUALITY_DESKTOP;
+        else if (strcmp(value, "auto") == 0)
+            val = -1;
+        else
+            status = -EINVAL;
+        if (status == 0 && in->resampler_quality_override != val) {
+            in->resampler_quality_override = val;
+            do_standby = true;
+        }
+    }
+
+    ret = str_parms_get_str(parms, AUDIO_PARAMETER_STREAM_BEAMFORMER_DELAY, value, sizeof(value));
+    if (ret >= 0)
+        in->beamformer_delay = MIN((unsigned int)atoi(value), BEAMFORMER_MAX_DELAY);
+
+    ret = str_parms_get_str(parms, AUDIO_PARAMETER_STREAM_BEAMFORMER, value, sizeof(value));
+    if (ret >= 0 && strcmp(value, AUDIO_PARAMETER_VALUE_ON) != 0 &&
+            strcmp(value, AUDIO_PARAMETER_VALUE_OFF) != 0) {
+        status = -EINVAL;
+    } else if (ret >= 0) {
+        in->beamformer = strcmp(value, AUDIO_PARAMETER_VALUE_ON) == 0;
+        if (!in->standby) {
+            capture_update_gains(adev);
+            capture_update_mic_mode(adev);
+        }
+    }
+
     if (do_standby)
         do_input_standby(in);
     pthread_mutex_unlock(&in->lock);
     pthread_mutex_unlock(&adev->lock);
 
     str_parms_destroy(parms);
-    return ret;
+    return status;
+}
+
+static int64_t timespec_to_ns(const struct timespec *ts)
+{
+    return (int64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+/* in_get_capture_position() returns the number of frames captured since the stream was
+ * started, at the requested sampling rate, and the CLOCK_MONOTONIC time at which the last
+ * of them was captured.
+ * must be called with input stream mutex locked */
+static int in_get_capture_position(struct espresso_stream_in *in,
+                                   int64_t *frames, int64_t *time)
+{
+    struct timespec tstamp;
+    struct timespec mono;
+    struct timespec real;
+    size_t kernel_frames;
+    int64_t buffered;
+
+    if (in->standby)
+        return -ENOSYS;
+
+    if (capture_get_htimestamp(&in->dev->capture, in, &kernel_frames, &tstamp) < 0)
+        return -ENOSYS;
+
+    /* frames captured but not returned by in_read() yet: in the kernel driver, the shared
+     * capture ring and in->read_buf at driver sampling rate, in in->proc_buf at requested
+     * sampling rate and those held by the resampler */
+    buffered = ((int64_t)(kernel_frames + in->read_buf_frames) * in->requested_rate) /
+                    in->config.rate + in->proc_buf_frames;
+    if (in->resampler)
+        buffered += ((int64_t)in->resampler->delay_ns(in->resampler) * in->requested_rate) /
+                        1000000000;
+
+    *frames = in->frames_read + buffered;
+
+    /* ALSA time stamps are taken from CLOCK_REALTIME */
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+    *time = timespec_to_ns(&tstamp) + timespec_to_ns(&mono) - timespec_to_ns(&real);
+
+    return 0;
 }
 
 static char * in_get_parameters(const struct audio_stream *stream,
                                 const char *keys)
 {
-    return strdup("");
+    struct espresso_stream_in *in = (struct espresso_stream_in *)stream;
+    struct str_parms *query = str_parms_create_str(keys);
+    struct str_parms *reply = str_parms_create();
+    char value[64];
+    char *str;
+    int64_t frames;
+    int64_t time;
+    int ret;
+
+    ret = str_parms_get_str(query, AUDIO_PARAMETER_STREAM_CAPTURE_POSITION,
+                            value, sizeof(value));
+    if (ret >= 0) {
+        pthread_mutex_lock(&in->lock);
+        ret = in_get_capture_position(in, &frames, &time);
+        pthread_mutex_unlock(&in->lock);
+        if (ret == 0) {
+            snprintf(value, sizeof(value), "%lld,%lld", frames, time);
+            str_parms_add_str(reply, AUDIO_PARAMETER_STREAM_CAPTURE_POSITION, value);
+        }
+    }
+
+    str = strdup(str_parms_to_str(reply));
+    str_parms_destroy(query);
+    str_parms_destroy(reply);
+    return str;
 }
 
 static int in_set_gain(struct audio_stream_in *stream, float gain)
 {
+    struct espresso_stream_in *in = (struct espresso_stream_in *)stream;
+    struct espresso_audio_device *adev = in->dev;
+    float gain_db;
+
+    if (gain <= 0.0f)
+        gain_db = MIN_CAPTURE_GAIN_DB;
+    else
+        gain_db = MIN(MAX(20.0f * log10f(gain), MIN_CAPTURE_GAIN_DB), MAX_CAPTURE_GAIN_DB);
+
+    pthread_mutex_lock(&adev->lock);
+    pthread_mutex_lock(&in->lock);
+    in->gain = powf(10.0f, gain_db / 20.0f);
+    if (!in->standby)
+        capture_update_gains(adev);
+    pthread_mutex_unlock(&in->lock);
+    pthread_mutex_unlock(&adev->lock);
+
     return 0;
 }
 
+/* applies the part of the stream gain not taken by the analog PGA.
+ * must be called with input stream mutex locked */
+static void in_apply_gain(struct espresso_stream_in *in, int16_t *buffer, size_t samples)
+{
+    int steps = in->analog_gain_steps;
+    float gain;
+
+    if (in->gain != in->applied_gain || steps != in->applied_gain_steps) {
+        in->applied_gain = in->gain;
+        in->applied_gain_steps = steps;
+
+        gain = in->gain / powf(10.0f, steps * IN_PGA_STEP_DB / 20.0f);
+        if (fabsf(gain - 1.0f) < 0.001f) {
+            in->gain_mant = 0;
+        } else {
+            /* a Q15 mantissa and a left shift: the mantissa is normalized to [0.5, 1) for
+             * an amplification and is the gain itself, in (0, 1), for an attenuation. It is
+             * kept above 0, which stands for unity gain. */
+            for (in->gain_shift = 0; gain >= 1.0f && in->gain_shift < 15; in->gain_shift++)
+                gain *= 0.5f;
+            in->gain_mant = (int16_t)MAX(MIN(gain * 32768.0f + 0.5f, 32767.0f), 1.0f);
+        }
+    }
+
+    if (in->gain_mant != 0)
+        dsp_apply_gain(buffer, samples, in->gain_mant, in->gain_shift);
+}
+
 static void get_capture_delay(struct espresso_stream_in *in,
                        size_t frames,
                        struct echo_reference_buffer *buffer)
 {
 
-    /* read frames available in kernel driver buffer */
+    /* read frames available in kernel driver buffer and in the shared capture ring */
     size_t kernel_frames;
     struct timespec tstamp;
     long buf_delay;
@@ -1622,7 +3145,7 @@ static void get_capture_delay(struct espresso_stream_in *in,
     long kernel_delay;
     long delay_ns;
 
-    if (pcm_get_htimestamp(in->pcm, &kernel_frames, &tstamp) < 0) {
+    if (capture_get_htimestamp(&in->dev->capture, in, &kernel_frames, &tstamp) < 0) {
         buffer->time_stamp.tv_sec  = 0;
         buffer->time_stamp.tv_nsec = 0;
         buffer->delay_ns           = 0;
@@ -1671,11 +3194,11 @@ static int32_t update_echo_reference(struct espresso_stream_in *in, size_t frame
     if (in->ref_buf_frames < frames) {
         if (in->ref_buf_size < frames) {
             in->ref_buf_size = frames;
-            in->ref_buf = (int16_t *)realloc(in->ref_buf, pcm_frames_to_bytes(in->pcm, frames));
+            in->ref_buf = (int16_t *)realloc(in->ref_buf, in_frames_to_bytes(in, frames));
             ALOG_ASSERT((in->ref_buf != NULL),
                         "%s failed to reallocate ref_buf", __func__);
             ALOGV("%s: ref_buf %p extended to %d bytes",
-                      __func__, in->ref_buf, pcm_frames_to_bytes(in->pcm, frames));
+                      __func__, in->ref_buf, in_frames_to_bytes(in, frames));
         }
         b.frame_count = frames - in->ref_buf_frames;
         b.raw = (void *)(in->ref_buf + in->ref_buf_frames * in->config.channels);
@@ -1738,6 +3261,14 @@ static void push_echo_reference(struct espresso_stream_in *in, size_t frames)
     if (in->ref_buf_frames < frames)
         frames = in->ref_buf_frames;
 
+    /* the timestamps only give an estimate of the delay: correct it with the lag measured
+     * between the reference and the echo in the signal given to the AEC */
+    if (in->echo_delay != NULL) {
+        echo_delay_push(in->echo_delay, in->proc_buf_in, in->config.channels,
+                        in->ref_buf, in->config.channels, frames);
+        delay_us = MAX(delay_us + echo_delay_get_us(in->echo_delay), 0);
+    }
+
     buf.frameCount = frames;
     buf.raw = in->ref_buf;
 
@@ -1770,7 +3301,7 @@ static int get_next_buffer(struct resampler_buffer_provider *buffer_provider,
     in = (struct espresso_stream_in *)((char *)buffer_provider -
                                    offsetof(struct espresso_stream_in, buf_provider));
 
-    if (in->pcm == NULL) {
+    if (in->standby) {
         buffer->raw = NULL;
         buffer->frame_count = 0;
         in->read_status = -ENODEV;
@@ -1778,7 +3309,7 @@ static int get_next_buffer(struct resampler_buffer_provider *buffer_provider,
     }
 
     if (in->read_buf_frames == 0) {
-        size_t size_in_bytes = pcm_frames_to_bytes(in->pcm, in->config.period_size);
+        size_t size_in_bytes = in_frames_to_bytes(in, in->config.period_size);
         if (in->read_buf_size < in->config.period_size) {
             in->read_buf_size = in->config.period_size;
             in->read_buf = (int16_t *) realloc(in->read_buf, size_in_bytes);
@@ -1788,10 +3319,11 @@ static int get_next_buffer(struct resampler_buffer_provider *buffer_provider,
                   __func__, in->read_buf, size_in_bytes);
         }
 
-        in->read_status = pcm_read(in->pcm, (void*)in->read_buf, size_in_bytes);
+        in->read_status = capture_read(&in->dev->capture, in, in->read_buf,
+                                       in->config.period_size);
 
         if (in->read_status != 0) {
-            ALOGE("%s: pcm_read error %d", __func__, in->read_status);
+            ALOGE("%s: capture_read error %d", __func__, in->read_status);
             buffer->raw = NULL;
             buffer->frame_count = 0;
             return in->read_status;
@@ -1833,7 +3365,7 @@ static ssize_t read_frames(struct espresso_stream_in *in, void *buffer, ssize_t
         if (in->resampler != NULL) {
             in->resampler->resample_from_provider(in->resampler,
                                                   (int16_t *)((char *)buffer +
-                                                      pcm_frames_to_bytes(in->pcm ,frames_wr)),
+                                                      in_frames_to_bytes(in, frames_wr)),
                                                   &frames_rd);
 
         } else {
@@ -1844,21 +3376,106 @@ static ssize_t read_frames(struct espresso_stream_in *in, void *buffer, ssize_t
             get_next_buffer(&in->buf_provider, &buf);
             if (buf.raw != NULL) {
                 memcpy((char *)buffer +
-                            pcm_frames_to_bytes(in->pcm, frames_wr),
+                            in_frames_to_bytes(in, frames_wr),
                         buf.raw,
-                        pcm_frames_to_bytes(in->pcm, buf.frame_count));
+                        in_frames_to_bytes(in, buf.frame_count));
                 frames_rd = buf.frame_count;
             }
             release_buffer(&in->buf_provider, &buf);
         }
-        /* in->read_status is updated by getNextBuffer() also called by
-         * in->resampler->resample_from_provider() */
-        if (in->read_status != 0)
-            return in->read_status;
+        /* in->read_status is updated by getNextBuffer() also called by
+         * in->resampler->resample_from_provider() */
+        if (in->read_status != 0)
+            return in->read_status;
+
+        frames_wr += frames_rd;
+    }
+    return frames_wr;
+}
+
+/* run_preprocessors() passes in_buf through the chain of pre processings. Each stage
+ * reads the output of the previous one from a ping-pong buffer and the last active stage
+ * writes directly to out_buf.
+ * A stage returning -ENODATA is disabled and bypassed. A stage consuming its input without
+ * producing frames defers its processing to a later effect of the same session (the pre
+ * processing library processes all effects when the last enabled one is called): the next
+ * stage then receives the same input.
+ * On return, in_buf->frameCount and out_buf->frameCount contain the number of frames
+ * consumed and produced. */
+static void run_preprocessors(struct espresso_stream_in *in,
+                              audio_buffer_t *in_buf,
+                              audio_buffer_t *out_buf)
+{
+    audio_buffer_t src = *in_buf;
+    size_t consumed = 0;
+    bool active = false;
+    bool produced = false;
+    int ping = 0;
+    int last;
+    int i;
+
+    /* guess the last active stage from the previous pass so that it can write to out_buf */
+    for (last = in->num_preprocessors - 1; last > 0; last--) {
+        if (!in->preprocessors[last].bypassed)
+            break;
+    }
+
+    for (i = 0; i < in->num_preprocessors; i++) {
+        struct effect_info_s *fx = &in->preprocessors[i];
+        audio_buffer_t stage_in = src;
+        audio_buffer_t stage_out;
+        struct timespec t0, t1;
+        int status;
+
+        stage_out.frameCount = out_buf->frameCount;
+        if (i == last)
+            stage_out.s16 = out_buf->s16;
+        else
+            stage_out.s16 = in->stage_buf[ping];
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        status = (*fx->effect_itfe)->process(fx->effect_itfe, &stage_in, &stage_out);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        fx->process_ns += (int64_t)(t1.tv_sec - t0.tv_sec) * 1000000000 +
+                              (t1.tv_nsec - t0.tv_nsec);
+        fx->process_count++;
+
+        fx->bypassed = (status == -ENODATA);
+        if (fx->bypassed)
+            continue;
+
+        /* the first active stage consumes frames from the process input buffer */
+        if (!active) {
+            consumed = stage_in.frameCount;
+            active = true;
+        }
 
-        frames_wr += frames_rd;
+        if (stage_out.frameCount == 0)
+            continue;
+
+        src.frameCount = stage_out.frameCount;
+        src.s16 = stage_out.s16;
+        produced = true;
+        if (stage_out.s16 != out_buf->s16)
+            ping ^= 1;
     }
-    return frames_wr;
+
+    if (!active) {
+        /* all stages bypassed: output is the input */
+        consumed = MIN(in_buf->frameCount, out_buf->frameCount);
+        src.frameCount = consumed;
+        produced = true;
+    }
+
+    if (!produced) {
+        out_buf->frameCount = 0;
+    } else {
+        out_buf->frameCount = MIN(src.frameCount, out_buf->frameCount);
+        /* a stage was bypassed or resumed since the previous pass */
+        if (src.s16 != out_buf->s16)
+            memcpy(out_buf->s16, src.s16, in_frames_to_bytes(in, out_buf->frameCount));
+    }
+    in_buf->frameCount = consumed;
 }
 
 /* process_frames() reads frames from kernel driver (via read_frames()),
@@ -1886,12 +3503,17 @@ static ssize_t process_frames(struct espresso_stream_in *in, void* buffer, ssize
             ssize_t frames_rd;
 
             if (in->proc_buf_size < (size_t)frames) {
-                size_t size_in_bytes = pcm_frames_to_bytes(in->pcm, frames);
+                size_t size_in_bytes = in_frames_to_bytes(in, frames);
 
                 in->proc_buf_size = (size_t)frames;
                 in->proc_buf_in = (int16_t *)realloc(in->proc_buf_in, size_in_bytes);
                 ALOG_ASSERT((in->proc_buf_in != NULL),
                             "%s failed to reallocate proc_buf_in", __func__);
+                for (i = 0; i < 2; i++) {
+                    in->stage_buf[i] = (int16_t *)realloc(in->stage_buf[i], size_in_bytes);
+                    ALOG_ASSERT((in->stage_buf[i] != NULL),
+                                "%s failed to reallocate stage_buf", __func__);
+                }
                 if (has_aux_channels) {
                     in->proc_buf_out = (int16_t *)realloc(in->proc_buf_out, size_in_bytes);
                     ALOG_ASSERT((in->proc_buf_out != NULL),
@@ -1922,16 +3544,7 @@ static ssize_t process_frames(struct espresso_stream_in *in, void* buffer, ssize
         out_buf.frameCount = frames - frames_wr;
         out_buf.s16 = (int16_t *)proc_buf_out + frames_wr * in->config.channels;
 
-        /* FIXME: this works because of current pre processing library implementation that
-         * does the actual process only when the last enabled effect process is called.
-         * The generic solution is to have an output buffer for each effect and pass it as
-         * input to the next.
-         */
-        for (i = 0; i < in->num_preprocessors; i++) {
-            (*in->preprocessors[i].effect_itfe)->process(in->preprocessors[i].effect_itfe,
-                                               &in_buf,
-                                               &out_buf);
-        }
+        run_preprocessors(in, &in_buf, &out_buf);
 
         /* process() has updated the number of frames consumed and produced in
          * in_buf.frameCount and out_buf.frameCount respectively
@@ -1963,32 +3576,49 @@ static ssize_t process_frames(struct espresso_stream_in *in, void* buffer, ssize
     /* Remove aux_channels that have been added on top of main_channels
      * Assumption is made that the channels are interleaved and that the main
      * channels are first. */
-    if (has_aux_channels)
-    {
-        size_t src_channels = in->config.channels;
-        size_t dst_channels = popcount(in->main_channels);
-        int16_t* src_buffer = (int16_t *)proc_buf_out;
-        int16_t* dst_buffer = (int16_t *)buffer;
-
-        if (dst_channels == 1) {
-            for (i = frames_wr; i > 0; i--)
-            {
-                *dst_buffer++ = *src_buffer;
-                src_buffer += src_channels;
-            }
-        } else {
-            for (i = frames_wr; i > 0; i--)
-            {
-                memcpy(dst_buffer, src_buffer, dst_channels*sizeof(int16_t));
-                dst_buffer += dst_channels;
-                src_buffer += src_channels;
-            }
-        }
-    }
+    if (has_aux_channels && frames_wr > 0)
+        dsp_extract_channels((int16_t *)buffer, popcount(in->main_channels),
+                             (int16_t *)proc_buf_out, in->config.channels, frames_wr);
 
     return frames_wr;
 }
 
+/* While the microphone is muted the capture PCM is only drained: the resampler and the
+ * pre processors are not run. The pre processors are not fed silence either, it would
+ * corrupt the noise and gain estimates they resume with.
+ * must be called with input stream mutex locked */
+static void in_set_muted(struct espresso_stream_in *in, bool muted)
+{
+    in->muted = muted;
+
+    if (muted) {
+        /* stop reading from echo reference: the output stops writing to it */
+        if (in->echo_reference != NULL)
+            in->echo_reference->read(in->echo_reference, NULL);
+        in->mute_frames_rem = 0;
+    }
+
+    /* frames buffered before muting are stale once unmuted */
+    in->read_buf_frames = 0;
+    in->proc_buf_frames = 0;
+    if (in->resampler)
+        in->resampler->reset(in->resampler);
+
+    ALOGV("%s: input %smuted", __func__, muted ? "" : "un");
+}
+
+/* consumes the capture frames corresponding to frames at the requested rate.
+ * must be called with input stream mutex locked */
+static int in_read_muted(struct espresso_stream_in *in, size_t frames)
+{
+    uint64_t capture_frames;
+
+    capture_frames = (uint64_t)frames * in->config.rate + in->mute_frames_rem;
+    in->mute_frames_rem = capture_frames % in->requested_rate;
+
+    return capture_skip(&in->dev->capture, in, (size_t)(capture_frames / in->requested_rate));
+}
+
 static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
                        size_t bytes)
 {
@@ -2013,18 +3643,39 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
     if (ret < 0)
         goto exit;
 
-    if (in->num_preprocessors != 0)
-        ret = process_frames(in, buffer, frames_rq);
-    else if (in->resampler != NULL)
-        ret = read_frames(in, buffer, frames_rq);
-    else
-        ret = pcm_read(in->pcm, buffer, bytes);
+    if (adev->mic_mute != in->muted)
+        in_set_muted(in, adev->mic_mute);
+
+    if (in->muted) {
+        ret = in_read_muted(in, frames_rq);
+        memset(buffer, 0, bytes);
+    } else {
+        if (in->num_preprocessors != 0)
+            ret = process_frames(in, buffer, frames_rq);
+        else if (in->resampler != NULL)
+            ret = read_frames(in, buffer, frames_rq);
+        else
+            ret = capture_read(&adev->capture, in, buffer, frames_rq);
+
+        if (ret >= 0)
+            in_apply_gain(in, (int16_t *)buffer, bytes / sizeof(int16_t));
+    }
+
+    if (ret >= 0) {
+        char name[16];
+
+        snprintf(name, sizeof(name), "in-source%d", in->source);
+        in->tap = update_tap(adev, in->tap, name, in->requested_rate,
+                             popcount(in->main_channels));
+        if (in->tap != NULL)
+            tap_write(in->tap, buffer, bytes);
+    }
 
     if (ret > 0)
         ret = 0;
 
-    if (ret == 0 && adev->mic_mute)
-        memset(buffer, 0, bytes);
+    if (ret == 0)
+        in->frames_read += frames_rq;
 
 exit:
     if (ret < 0)
@@ -2037,7 +3688,16 @@ exit:
 
 static uint32_t in_get_input_frames_lost(struct audio_stream_in *stream)
 {
-    return 0;
+    struct espresso_stream_in *in = (struct espresso_stream_in *)stream;
+    uint32_t frames_lost;
+
+    /* frames are lost at the capture rate, report them at the requested rate */
+    pthread_mutex_lock(&in->lock);
+    frames_lost = (uint32_t)(((uint64_t)in->frames_lost * in->requested_rate) / in->config.rate);
+    in->frames_lost = 0;
+    pthread_mutex_unlock(&in->lock);
+
+    return frames_lost;
 }
 
 #define GET_COMMAND_STATUS(status, fct_status, cmd_status) \
@@ -2327,9 +3987,20 @@ static int in_add_audio_effect(const struct audio_stream *stream,
 
     pthread_mutex_lock(&in->dev->lock);
     pthread_mutex_lock(&in->lock);
-    if (in->num_preprocessors >= MAX_PREPROCESSORS) {
-        status = -ENOSYS;
-        goto exit;
+    if (in->num_preprocessors >= in->preprocessors_size) {
+        int size = in->preprocessors_size ?
+                        in->preprocessors_size * 2 : PREPROCESSORS_INITIAL_SIZE;
+        struct effect_info_s *preprocessors =
+                realloc(in->preprocessors, size * sizeof(struct effect_info_s));
+
+        if (!preprocessors) {
+            status = -ENOMEM;
+            goto exit;
+        }
+        memset(preprocessors + in->preprocessors_size, 0,
+               (size - in->preprocessors_size) * sizeof(struct effect_info_s));
+        in->preprocessors = preprocessors;
+        in->preprocessors_size = size;
     }
 
     status = (*effect)->get_descriptor(effect, &desc);
@@ -2378,9 +4049,7 @@ static int in_remove_audio_effect(const struct audio_stream *stream,
 
     for (i = 0; i < in->num_preprocessors; i++) {
         if (status == 0) { /* status == 0 means an effect was removed from a previous slot */
-            in->preprocessors[i - 1].effect_itfe = in->preprocessors[i].effect_itfe;
-            in->preprocessors[i - 1].channel_configs = in->preprocessors[i].channel_configs;
-            in->preprocessors[i - 1].num_channel_configs = in->preprocessors[i].num_channel_configs;
+            in->preprocessors[i - 1] = in->preprocessors[i];
             ALOGI("in_remove_audio_effect moving fx from %d to %d", i, i - 1);
             continue;
         }
@@ -2396,9 +4065,7 @@ static int in_remove_audio_effect(const struct audio_stream *stream,
 
     in->num_preprocessors--;
     /* if we remove one effect, at least the last preproc should be reset */
-    in->preprocessors[in->num_preprocessors].num_channel_configs = 0;
-    in->preprocessors[in->num_preprocessors].effect_itfe = NULL;
-    in->preprocessors[in->num_preprocessors].channel_configs = NULL;
+    memset(&in->preprocessors[in->num_preprocessors], 0, sizeof(struct effect_info_s));
 
 
     /* check compatibility between main channel supported and possible auxiliary channels */
@@ -2529,6 +4196,18 @@ static void adev_close_output_stream(struct audio_hw_device *dev,
     free(stream);
 }
 
+/* the writer thread is started the first time taps are enabled and runs until the device
+ * is closed: streams may still have taps open when taps are disabled.
+ * must be called with hw device mutex locked */
+static void adev_enable_taps(struct espresso_audio_device *adev, bool enable)
+{
+    if (enable && adev->tap_writer == NULL)
+        adev->tap_writer = tap_writer_create(AUDIO_TAP_DIR);
+
+    android_atomic_release_store(enable && adev->tap_writer != NULL, &adev->tap_enabled);
+    ALOGI("%s: debug taps %s", __func__, adev->tap_enabled ? "enabled" : "disabled");
+}
+
 static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
 {
     struct espresso_audio_device *adev = (struct espresso_audio_device *)dev;
@@ -2570,6 +4249,37 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
             adev->bluetooth_nrec = false;
     }
 
+    ret = str_parms_get_str(parms, AUDIO_PARAMETER_KEY_CAPTURE_PREROLL, value, sizeof(value));
+    if (ret >= 0) {
+        unsigned int preroll_ms = MIN((unsigned int)atoi(value), CAPTURE_PREROLL_MAX_MS);
+
+        pthread_mutex_lock(&adev->lock);
+        if (preroll_ms != adev->capture.preroll_ms) {
+            /* the ring is resized the next time the PCM is opened */
+            capture_stop_idle(adev);
+            pthread_mutex_lock(&adev->capture.lock);
+            adev->capture.preroll_ms = preroll_ms;
+            pthread_mutex_unlock(&adev->capture.lock);
+            capture_start_preroll(adev);
+        }
+        pthread_mutex_unlock(&adev->lock);
+    }
+
+    /* applied when the inputs leave standby */
+    ret = str_parms_get_str(parms, AUDIO_PARAMETER_KEY_DC_BLOCK_DEVICES, value, sizeof(value));
+    if (ret >= 0) {
+        pthread_mutex_lock(&adev->lock);
+        adev->dc_block_devices = (int)strtoul(value, NULL, 0) & ~AUDIO_DEVICE_BIT_IN;
+        pthread_mutex_unlock(&adev->lock);
+    }
+
+    ret = str_parms_get_str(parms, AUDIO_PARAMETER_KEY_DEBUG_TAP, value, sizeof(value));
+    if (ret >= 0) {
+        pthread_mutex_lock(&adev->lock);
+        adev_enable_taps(adev, strcmp(value, AUDIO_PARAMETER_VALUE_ON) == 0);
+        pthread_mutex_unlock(&adev->lock);
+    }
+
     ret = str_parms_get_str(parms, "screen_off", value, sizeof(value));
     if (ret >= 0) {
         if (strcmp(value, AUDIO_PARAMETER_VALUE_ON) == 0)
@@ -2650,7 +4360,9 @@ static size_t adev_get_input_buffer_size(const struct audio_hw_device *dev,
     if (check_input_parameters(config->sample_rate, config->format, channel_count) != 0)
         return 0;
 
-    return get_input_buffer_size(config->sample_rate, config->format, channel_count);
+    /* the audio source is only known when the stream starts */
+    return get_input_buffer_size(config->sample_rate, config->format, channel_count,
+                                 AUDIO_SOURCE_DEFAULT);
 }
 
 static int adev_open_input_stream(struct audio_hw_device *dev,
@@ -2664,7 +4376,8 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     int ret;
 
     /* Respond with a request for stereo if a different format is given. */
-    if (config->channel_mask != AUDIO_CHANNEL_IN_STEREO) {
+    if (config->channel_mask != AUDIO_CHANNEL_IN_MONO &&
+            config->channel_mask != AUDIO_CHANNEL_IN_STEREO) {
         config->channel_mask = AUDIO_CHANNEL_IN_STEREO;
         return -EINVAL;
     }
@@ -2697,6 +4410,9 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     in->stream.get_input_frames_lost = in_get_input_frames_lost;
 
     in->requested_rate = config->sample_rate;
+    in->resampler_quality_override = -1;
+    in->gain = 1.0f;
+    in->applied_gain = 1.0f;
 
     memcpy(&in->config, &pcm_config_capture, sizeof(pcm_config_capture));
     in->config.channels = channel_count;
@@ -2706,21 +4422,13 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     /* initialisation of preprocessor structure array is implicit with the calloc.
      * same for in->aux_channels and in->aux_channels_changed */
 
-    if (in->requested_rate != in->config.rate) {
-        in->buf_provider.get_next_buffer = get_next_buffer;
-        in->buf_provider.release_buffer = release_buffer;
+    ret = in_configure_resampler(in);
+    if (ret != 0)
+        goto err;
 
-        ret = create_resampler(in->config.rate,
-                               in->requested_rate,
-                               in->config.channels,
-                               RESAMPLER_QUALITY_DEFAULT,
-                               &in->buf_provider,
-                               &in->resampler);
-        if (ret != 0) {
-            ret = -EINVAL;
-            goto err;
-        }
-    }
+    /* created once: its thread sleeps until the AEC pushes a full history */
+    if (ladev->echo_delay_estimation)
+        in->echo_delay = echo_delay_create(in->requested_rate);
 
     in->dev = ladev;
     in->standby = 1;
@@ -2745,9 +4453,13 @@ static void adev_close_input_stream(struct audio_hw_device *dev,
 
     in_standby(&stream->common);
 
+    if (in->echo_delay != NULL)
+        echo_delay_destroy(in->echo_delay);
+
     for (i = 0; i < in->num_preprocessors; i++) {
         free(in->preprocessors[i].channel_configs);
     }
+    free(in->preprocessors);
 
     free(in->read_buf);
     if (in->resampler) {
@@ -2757,6 +4469,8 @@ static void adev_close_input_stream(struct audio_hw_device *dev,
         free(in->proc_buf_in);
     if (in->proc_buf_out)
         free(in->proc_buf_out);
+    free(in->stage_buf[0]);
+    free(in->stage_buf[1]);
     if (in->ref_buf)
         free(in->ref_buf);
 
@@ -2766,6 +4480,14 @@ static void adev_close_input_stream(struct audio_hw_device *dev,
 
 static int adev_dump(const audio_hw_device_t *device, int fd)
 {
+    struct espresso_audio_device *adev = (struct espresso_audio_device *)device;
+    static const char header[] = "Route change latency by output device pair:\n";
+
+    if (adev->route_stats) {
+        write(fd, header, sizeof(header) - 1);
+        latency_stats_dump(adev->route_stats, fd, route_stage_names);
+    }
+
     return 0;
 }
 
@@ -2773,21 +4495,60 @@ static int adev_close(hw_device_t *device)
 {
     struct espresso_audio_device *adev = (struct espresso_audio_device *)device;
 
+    pthread_mutex_lock(&adev->lock);
+    capture_stop_idle(adev);
+    pthread_mutex_unlock(&adev->lock);
+
+    if (adev->tap_writer)
+        tap_writer_destroy(adev->tap_writer);
+
     /* RIL */
     ril_close(&adev->ril);
 
+    if (adev->config_watch) {
+        write(adev->config_exit_pipe[1], "", 1);
+        pthread_join(adev->config_thread, NULL);
+        close(adev->config_exit_pipe[0]);
+        close(adev->config_exit_pipe[1]);
+    }
+
+    pthread_mutex_lock(&adev->route_lock);
+    adev->route_exit = true;
+    pthread_cond_broadcast(&adev->route_cond);
+    pthread_mutex_unlock(&adev->route_lock);
+    pthread_join(adev->route_thread, NULL);
+
+    if (adev->route_table)
+        route_table_free(adev->route_table);
+    if (adev->route_next_table)
+        route_table_free(adev->route_next_table);
+    if (adev->route_stats)
+        latency_stats_destroy(adev->route_stats);
+
+    mixer_shadow_destroy(adev->mixer_shadow);
     mixer_close(adev->mixer);
+    free(adev->route_target);
+    free(adev->route_touched);
+    free(adev->capture.ring);
     free(device);
     return 0;
 }
 
 struct config_parse_state {
     struct espresso_audio_device *adev;
+    struct route_table *table;
     struct espresso_dev_cfg *dev;
     bool on;
+    bool ignore;                /* inside an unknown device or use case */
 
+    /* the path being parsed, copied to the arena once complete */
     struct route_setting *path;
     unsigned int path_len;
+    unsigned int path_max;
+
+    /* records the paths parsed for the route cache */
+    struct route_cache_writer *cache;
+    int cache_status;
 };
 
 static const struct {
@@ -2797,8 +4558,7 @@ static const struct {
     { AUDIO_DEVICE_OUT_SPEAKER, "speaker" },
     { AUDIO_DEVICE_OUT_WIRED_HEADSET | AUDIO_DEVICE_OUT_WIRED_HEADPHONE, "headphone" },
     { AUDIO_DEVICE_OUT_EARPIECE, "earpiece" },
-    { AUDIO_DEVICE_OUT_ANLG_DOCK_HEADSET, "dock" },
-    { AUDIO_DEVICE_OUT_DGTL_DOCK_HEADSET, "dock" },
+    { AUDIO_DEVICE_OUT_ANLG_DOCK_HEADSET | AUDIO_DEVICE_OUT_DGTL_DOCK_HEADSET, "dock" },
     { AUDIO_DEVICE_OUT_ALL_SCO, "sco-out" },
 
     { AUDIO_DEVICE_IN_BUILTIN_MIC, "builtin-mic" },
@@ -2806,11 +4566,81 @@ static const struct {
     { AUDIO_DEVICE_IN_ALL_SCO, "sco-in" },
 };
 
+/* indexed by enum use_case */
+static const char * const use_case_names[USE_CASE_CNT] = {
+    [USE_CASE_DUAL_MIC_INPUT] = "dual-mic-input",
+    [USE_CASE_VOICECALL_DEFAULT] = "voicecall-default",
+    [USE_CASE_VOICECALL_DEFAULT_DISABLE] = "voicecall-default-disable",
+    [USE_CASE_DEFAULT_INPUT] = "default-input",
+    [USE_CASE_DEFAULT_INPUT_DISABLE] = "default-input-disable",
+    [USE_CASE_HEADSET_INPUT] = "headset-input",
+    [USE_CASE_BT_INPUT] = "bt-input",
+    [USE_CASE_BT_OUTPUT] = "bt-output",
+};
+
+/* returns the hash of the tables above: the route cache records the masks the names were
+ * mapped to */
+static uint32_t adev_config_names_hash(void)
+{
+    uint32_t h = ROUTE_CACHE_HASH_INIT;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(dev_names) / sizeof(dev_names[0]); i++) {
+        h = route_cache_hash(h, &dev_names[i].mask, sizeof(dev_names[i].mask));
+        h = route_cache_hash(h, dev_names[i].name, strlen(dev_names[i].name) + 1);
+    }
+    for (i = 0; i < USE_CASE_CNT; i++) {
+        if (use_case_names[i])
+            h = route_cache_hash(h, use_case_names[i], strlen(use_case_names[i]) + 1);
+        else
+            h = route_cache_hash(h, "", 1);
+    }
+
+    return h;
+}
+
+/* appends a device or use case configuration, the paths parsed next belong to it */
+static struct espresso_dev_cfg *adev_config_add_cfg(struct route_table *table, int mask,
+                                                    uint32_t use_cases)
+{
+    struct espresso_dev_cfg *dev_cfg;
+
+    dev_cfg = realloc(table->dev_cfgs, (table->num_dev_cfgs + 1) * sizeof(*dev_cfg));
+    if (!dev_cfg)
+        return NULL;
+
+    table->dev_cfgs = dev_cfg;
+    dev_cfg = &dev_cfg[table->num_dev_cfgs++];
+    memset(dev_cfg, 0, sizeof(*dev_cfg));
+    dev_cfg->mask = mask;
+    dev_cfg->use_cases = use_cases;
+    return dev_cfg;
+}
+
+/* appends a path outside of the devices and use cases to the default route, which is
+ * applied when the table is installed */
+static int adev_config_add_defaults(struct route_table *table, struct route_setting *path,
+                                    unsigned int len)
+{
+    struct route_setting *r;
+
+    if (!len)
+        return 0;
+
+    r = realloc(table->defaults, (table->defaults_len + len) * sizeof(*r));
+    if (!r)
+        return -ENOMEM;
+
+    memcpy(r + table->defaults_len, path, len * sizeof(*r));
+    table->defaults = r;
+    table->defaults_len += len;
+    return 0;
+}
+
 static void adev_config_start(void *data, const XML_Char *elem,
                   const XML_Char **attr)
 {
     struct config_parse_state *s = data;
-    struct espresso_dev_cfg *dev_cfg;
     const XML_Char *name = NULL;
     const XML_Char *val = NULL;
     unsigned int i, j;
@@ -2823,31 +4653,57 @@ static void adev_config_start(void *data, const XML_Char *elem,
         val = attr[i + 1];
     }
 
+    if (s->ignore)
+    return;
+
     if (strcmp(elem, "device") == 0) {
     if (!name) {
         ALOGE("Unnamed device\n");
+        s->ignore = true;
         return;
     }
 
     for (i = 0; i < sizeof(dev_names) / sizeof(dev_names[0]); i++) {
         if (strcmp(dev_names[i].name, name) == 0) {
         ALOGI("Allocating device %s\n", name);
-        dev_cfg = realloc(s->adev->dev_cfgs,
-                  (s->adev->num_dev_cfgs + 1)
-                  * sizeof(*dev_cfg));
-        if (!dev_cfg) {
+        s->dev = adev_config_add_cfg(s->table, dev_names[i].mask, 0);
+        if (!s->dev) {
             ALOGE("Unable to allocate dev_cfg\n");
             return;
         }
+        s->cache_status |= route_cache_add_path(s->cache, s->dev->mask, ROUTE_CACHE_DEVICE);
+        }
+    }
+    if (!s->dev) {
+        ALOGW("Unknown device %s\n", name);
+        s->ignore = true;
+    }
 
-        s->dev = &dev_cfg[s->adev->num_dev_cfgs];
-        memset(s->dev, 0, sizeof(*s->dev));
-        s->dev->mask = dev_names[i].mask;
+    } else if (strcmp(elem, "usecase") == 0) {
+    if (!name) {
+        ALOGE("Unnamed use case\n");
+        s->ignore = true;
+        return;
+    }
 
-        s->adev->dev_cfgs = dev_cfg;
-        s->adev->num_dev_cfgs++;
-        }
+    for (i = 0; i < USE_CASE_CNT; i++) {
+        if (strcmp(use_case_names[i], name) == 0)
+        break;
+    }
+    if (i == USE_CASE_CNT) {
+        ALOGW("Unknown use case %s\n", name);
+        s->ignore = true;
+        return;
+    }
+
+    ALOGI("Allocating use case %s\n", name);
+    s->dev = adev_config_add_cfg(s->table, 0, USE_CASE_BIT(i));
+    if (!s->dev) {
+        ALOGE("Unable to allocate dev_cfg\n");
+        s->ignore = true;
+        return;
     }
+    s->cache_status |= route_cache_add_path(s->cache, i, ROUTE_CACHE_USE_CASE);
 
     } else if (strcmp(elem, "path") == 0) {
     if (s->path_len)
@@ -2880,91 +4736,228 @@ static void adev_config_start(void *data, const XML_Char *elem,
 
     ALOGV("Parsing control %s => %s\n", name, val);
 
-    r = realloc(s->path, sizeof(*r) * (s->path_len + 1));
-    if (!r) {
+    if (s->path_len == s->path_max) {
+        r = realloc(s->path, sizeof(*r) * (s->path_max ? s->path_max * 2 : 16));
+        if (!r) {
+            ALOGE("Out of memory handling %s => %s\n", name, val);
+            return;
+        }
+        s->path = r;
+        s->path_max = s->path_max ? s->path_max * 2 : 16;
+    }
+    r = s->path;
+
+    r[s->path_len].ctl_name = arena_strdup(s->table->arena, name);
+    if (!r[s->path_len].ctl_name) {
         ALOGE("Out of memory handling %s => %s\n", name, val);
         return;
     }
-
-    r[s->path_len].ctl_name = strdup(name);
     r[s->path_len].strval = NULL;
+    r[s->path_len].ctl_id = mixer_shadow_find(s->adev->mixer_shadow, name);
+    r[s->path_len].resolved = true;
+    if (r[s->path_len].ctl_id < 0)
+        ALOGE("Unknown control '%s'\n", name);
 
     /* This can be fooled but it'll do */
     r[s->path_len].intval = atoi(val);
     if (!r[s->path_len].intval && strcmp(val, "0") != 0)
-        r[s->path_len].strval = strdup(val);
+        r[s->path_len].strval = arena_strdup(s->table->arena, val);
 
-    s->path = r;
     s->path_len++;
     }
 }
 
+/* copies the path parsed to the arena */
+static struct route_setting *adev_config_keep_path(struct config_parse_state *s)
+{
+    struct route_setting *path;
+
+    if (!s->path_len)
+        return NULL;
+
+    path = arena_alloc(s->table->arena, s->path_len * sizeof(*path));
+    if (!path) {
+        ALOGE("Out of memory keeping a %d element path\n", s->path_len);
+        return NULL;
+    }
+    memcpy(path, s->path, s->path_len * sizeof(*path));
+    return path;
+}
+
 static void adev_config_end(void *data, const XML_Char *name)
 {
     struct config_parse_state *s = data;
+    struct route_setting *path;
     unsigned int i;
 
+    if (s->ignore) {
+    if (strcmp(name, "device") == 0 || strcmp(name, "usecase") == 0)
+        s->ignore = false;
+    return;
+    }
+
     if (strcmp(name, "path") == 0) {
     if (!s->path_len)
         ALOGW("Empty path\n");
 
-    if (!s->dev) {
-        ALOGV("Applying %d element default route\n", s->path_len);
-
-        set_route_by_array(s->adev->mixer, s->path, s->path_len);
-
-        for (i = 0; i < s->path_len; i++) {
-        free(s->path[i].ctl_name);
-        free(s->path[i].strval);
-        }
+    s->cache_status |= route_cache_add_path(s->cache, s->dev ? s->dev->mask : 0,
+            !s->dev ? ROUTE_CACHE_DEFAULT : s->on ? ROUTE_CACHE_ON : ROUTE_CACHE_OFF);
+    for (i = 0; i < s->path_len; i++)
+        s->cache_status |= route_cache_add_ctl(s->cache, s->path[i].ctl_name,
+                                               s->path[i].intval, s->path[i].strval);
 
-        free(s->path);
+    if (!s->dev) {
+        ALOGV("%d element default route\n", s->path_len);
+        if (adev_config_add_defaults(s->table, s->path, s->path_len) != 0)
+            ALOGE("Out of memory keeping a %d element path\n", s->path_len);
 
         /* Refactor! */
     } else if (s->on) {
         ALOGV("%d element on sequence\n", s->path_len);
-        s->dev->on = s->path;
-        s->dev->on_len = s->path_len;
+        path = adev_config_keep_path(s);
+        s->dev->on = path;
+        s->dev->on_len = path ? s->path_len : 0;
 
     } else {
         ALOGV("%d element off sequence\n", s->path_len);
-
-        /* Apply it, we'll reenable anything that's wanted later */
-        set_route_by_array(s->adev->mixer, s->path, s->path_len);
-
-        s->dev->off = s->path;
-        s->dev->off_len = s->path_len;
+        path = adev_config_keep_path(s);
+        s->dev->off = path;
+        s->dev->off_len = path ? s->path_len : 0;
     }
 
     s->path_len = 0;
-    s->path = NULL;
 
-    } else if (strcmp(name, "device") == 0) {
+    } else if (strcmp(name, "device") == 0 || strcmp(name, "usecase") == 0) {
     s->dev = NULL;
     }
 }
 
-static int adev_config_parse(struct espresso_audio_device *adev)
+/* replays the paths of the route cache as adev_config_start() and adev_config_end() do
+ * while parsing the configuration file. The control names stay in the cache, the paths
+ * are allocated from the arena of the table. */
+static int adev_config_load_cache(struct espresso_audio_device *adev, struct route_table *table,
+                                  struct route_cache *cache)
+{
+    struct espresso_dev_cfg *dev = NULL;
+    struct route_setting *path;
+    enum route_cache_kind kind;
+    const char *name;
+    const char *strval;
+    unsigned int num_paths = route_cache_num_paths(cache);
+    unsigned int len;
+    unsigned int i, j;
+    int mask;
+
+    for (i = 0; i < num_paths; i++) {
+        len = route_cache_get_path(cache, i, &mask, &kind);
+
+        if (kind == ROUTE_CACHE_DEVICE || kind == ROUTE_CACHE_USE_CASE) {
+            if (kind == ROUTE_CACHE_USE_CASE && (mask < 0 || mask >= USE_CASE_CNT))
+                return -EINVAL;
+            dev = kind == ROUTE_CACHE_DEVICE ? adev_config_add_cfg(table, mask, 0) :
+                                               adev_config_add_cfg(table, 0, USE_CASE_BIT(mask));
+            if (!dev)
+                return -ENOMEM;
+            continue;
+        }
+
+        path = arena_alloc(table->arena, len * sizeof(*path));
+        if (!path)
+            return -ENOMEM;
+
+        for (j = 0; j < len; j++) {
+            route_cache_get_ctl(cache, i, j, &name, &path[j].intval, &strval);
+            path[j].ctl_name = (char *)name;
+            path[j].strval = (char *)strval;
+            path[j].ctl_id = mixer_shadow_find(adev->mixer_shadow, name);
+            path[j].resolved = true;
+        }
+
+        if (kind == ROUTE_CACHE_DEFAULT || dev == NULL) {
+            if (adev_config_add_defaults(table, path, len) != 0)
+                return -ENOMEM;
+        } else if (kind == ROUTE_CACHE_ON) {
+            dev->on = path;
+            dev->on_len = len;
+        } else {
+            dev->off = path;
+            dev->off_len = len;
+        }
+    }
+
+    return 0;
+}
+
+/* parses the mixer configuration file, or loads its route cache, into a new route table.
+ * Called at open and by the configuration watcher: the mixer is not written here. */
+static int adev_config_parse(struct espresso_audio_device *adev, struct route_table **tablep)
 {
     struct config_parse_state s;
-    FILE *f;
+    struct route_table *table;
+    struct stat st;
     XML_Parser p;
     char property[PROPERTY_VALUE_MAX];
     char file[80];
+    char cache_file[PATH_MAX];
+    struct route_cache *cache;
+    struct route_cache_source source;
+    uint32_t names_hash = adev_config_names_hash();
+    void *buf;
     int ret = 0;
-    bool eof = false;
-    int len;
+    int fd;
 
+    memset(&s, 0, sizeof(s));
     property_get("ro.product.device", property, "tiny_hw");
-    snprintf(file, sizeof(file), "/system/etc/sound/%s", property);
+    snprintf(file, sizeof(file), "%s/%s", MIXER_CONFIG_DIR, property);
+    snprintf(cache_file, sizeof(cache_file), "%s/%s.routes", ROUTE_CACHE_DIR, property);
+
+    table = route_table_create();
+    if (!table)
+        return -ENOMEM;
+
+    cache = route_cache_open(cache_file, file, names_hash);
+    if (cache) {
+        ALOGV("Reading configuration from %s\n", cache_file);
+        table->cache = cache;
+        ret = adev_config_load_cache(adev, table, cache);
+        if (ret == 0)
+            goto done;
+
+        /* the file is still there: drop the image and start over from it */
+        ALOGW("Failed to load %s: %d\n", cache_file, ret);
+        route_table_free(table);
+        unlink(cache_file);
+        ret = 0;
+        table = route_table_create();
+        if (!table)
+            return -ENOMEM;
+    }
 
     ALOGV("Reading configuration from %s\n", file);
-    f = fopen(file, "r");
-    if (!f) {
+    fd = open(file, O_RDONLY);
+    if (fd < 0) {
     ALOGE("Failed to open %s\n", file);
-    return -ENODEV;
+    ret = -ENODEV;
+    goto done;
     }
 
+    /* the whole file is parsed in a single pass */
+    if (fstat(fd, &st) != 0 || st.st_size <= 0 || st.st_size > INT_MAX) {
+    ALOGE("Failed to get the size of %s\n", file);
+    close(fd);
+    ret = -EIO;
+    goto done;
+    }
+    buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED) {
+    ALOGE("Failed to map %s\n", file);
+    ret = -EIO;
+    goto done;
+    }
+    /* the image written is checked against the version of the file parsed */
+    route_cache_get_source(&source, buf, st.st_size, (int64_t)st.st_mtime, names_hash);
+
     p = XML_ParserCreate(NULL);
     if (!p) {
     ALOGE("Failed to create XML parser\n");
@@ -2972,42 +4965,135 @@ static int adev_config_parse(struct espresso_audio_device *adev)
     goto out;
     }
 
-    memset(&s, 0, sizeof(s));
     s.adev = adev;
+    s.table = table;
+    s.cache = route_cache_writer_create();
+    if (!s.cache) {
+    ret = -ENOMEM;
+    goto out_parser;
+    }
     XML_SetUserData(p, &s);
 
     XML_SetElementHandler(p, adev_config_start, adev_config_end);
 
-    while (!eof) {
-    len = fread(file, 1, sizeof(file), f);
-    if (ferror(f)) {
-        ALOGE("I/O error reading config\n");
-        ret = -EIO;
-        goto out_parser;
-    }
-    eof = feof(f);
-
-    if (XML_Parse(p, file, len, eof) == XML_STATUS_ERROR) {
-        ALOGE("Parse error at line %u:\n%s\n",
+    if (XML_Parse(p, buf, (int)st.st_size, 1) == XML_STATUS_ERROR) {
+    ALOGE("Parse error at line %u:\n%s\n",
          (unsigned int)XML_GetCurrentLineNumber(p),
          XML_ErrorString(XML_GetErrorCode(p)));
-        ret = -EINVAL;
-        goto out_parser;
-    }
+    ret = -EINVAL;
     }
 
  out_parser:
     XML_ParserFree(p);
  out:
-    fclose(f);
+    munmap(buf, st.st_size);
+    free(s.path);
+
+    if (ret == 0) {
+        if (s.cache_status == 0)
+            s.cache_status = route_cache_write(s.cache, cache_file, &source);
+        if (s.cache_status != 0)
+            ALOGW("Failed to write %s: %d\n", cache_file, s.cache_status);
+    }
+    if (s.cache)
+        route_cache_writer_destroy(s.cache);
 
-    return ret;
+ done:
+    if (ret != 0) {
+        route_table_free(table);
+        return ret;
+    }
+
+    compile_dev_cfgs(table);
+    ALOGV("%zu bytes of routes\n", arena_get_size(table->arena));
+    *tablep = table;
+    return 0;
+}
+
+/* config_watch_thread() parses the mixer configuration file again each time it is written
+ * or replaced, and hands the new route table to the routing thread, which installs it
+ * before the next route. The routes in use stay in place if the file does not parse. */
+static void *config_watch_thread(void *context)
+{
+    struct espresso_audio_device *adev = (struct espresso_audio_device *)context;
+    struct route_table *table;
+    struct route_table *old;
+    struct inotify_event *event;
+    struct pollfd fds[2];
+    char property[PROPERTY_VALUE_MAX];
+    char buf[sizeof(struct inotify_event) + NAME_MAX + 1]
+            __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+    ssize_t len;
+    ssize_t i;
+    int ret;
+    int fd;
+
+    property_get("ro.product.device", property, "tiny_hw");
+
+    fd = inotify_init();
+    if (fd < 0) {
+        ALOGE("%s: inotify_init() failed: %s", __func__, strerror(errno));
+        return NULL;
+    }
+    /* the directory is watched as the file may be replaced rather than written */
+    if (inotify_add_watch(fd, MIXER_CONFIG_DIR, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        ALOGE("%s: cannot watch %s: %s", __func__, MIXER_CONFIG_DIR, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    fds[0].fd = fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = adev->config_exit_pipe[0];
+    fds[1].events = POLLIN;
+
+    for (;;) {
+        /* the file is reloaded once it stops changing */
+        ret = poll(fds, 2, changed ? CONFIG_WATCH_SETTLE_MS : -1);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0 || fds[1].revents)
+            break;
+
+        if (ret == 0) {
+            changed = false;
+            ALOGI("%s: reloading the mixer configuration", __func__);
+            if (adev_config_parse(adev, &table) != 0) {
+                ALOGE("%s: keeping the current routes", __func__);
+                continue;
+            }
+
+            pthread_mutex_lock(&adev->route_lock);
+            old = adev->route_next_table;
+            adev->route_next_table = table;
+            pthread_cond_broadcast(&adev->route_cond);
+            pthread_mutex_unlock(&adev->route_lock);
+
+            /* replaced before the routing thread installed it */
+            if (old)
+                route_table_free(old);
+            continue;
+        }
+
+        len = read(fd, buf, sizeof(buf));
+        for (i = 0; i + (ssize_t)sizeof(struct inotify_event) <= len;
+                i += sizeof(struct inotify_event) + event->len) {
+            event = (struct inotify_event *)(buf + i);
+            if (event->len && strcmp(event->name, property) == 0)
+                changed = true;
+        }
+    }
+
+    close(fd);
+    return NULL;
 }
 
 static int adev_open(const hw_module_t* module, const char* name,
                      hw_device_t** device)
 {
     struct espresso_audio_device *adev;
+    char value[PROPERTY_VALUE_MAX];
     int i, ret;
 
     if (strcmp(name, AUDIO_HARDWARE_INTERFACE) != 0)
@@ -3044,16 +5130,47 @@ static int adev_open(const hw_module_t* module, const char* name,
         return -EINVAL;
     }
 
-	ret = adev_config_parse(adev);
+    adev->mixer_shadow = mixer_shadow_create(adev->mixer);
+    if (!adev->mixer_shadow) {
+        mixer_close(adev->mixer);
+        free(adev);
+        ALOGE("Unable to create the mixer shadow, aborting.");
+        return -ENOMEM;
+    }
+
+    adev->route_target = calloc(mixer_shadow_get_num_ctls(adev->mixer_shadow),
+                                sizeof(*adev->route_target));
+    adev->route_touched = calloc(mixer_shadow_get_num_ctls(adev->mixer_shadow),
+                                 sizeof(*adev->route_touched));
+    if (!adev->route_target || !adev->route_touched) {
+        ALOGE("Unable to allocate the route targets, aborting.");
+        goto err_mixer;
+    }
+
+	/* installed by the routing thread before the first route */
+	ret = adev_config_parse(adev, &adev->route_next_table);
 	if (ret != 0)
 		goto err_mixer;
 
     /* Set the default route before the PCM stream is opened */
     pthread_mutex_init(&adev->lock, NULL);
+    pthread_mutex_init(&adev->capture.lock, NULL);
+    pthread_cond_init(&adev->capture.idle_cond, NULL);
+    pthread_cond_init(&adev->capture.read_cond, NULL);
+    pthread_mutex_init(&adev->route_lock, NULL);
+    pthread_cond_init(&adev->route_cond, NULL);
+    adev->route_stats = latency_stats_create(ROUTE_STAGE_CNT);
+    if (!adev->route_stats)
+        ALOGW("Unable to allocate the route statistics");
+    if (pthread_create(&adev->route_thread, NULL, route_thread, adev) != 0) {
+        ALOGE("Unable to create the routing thread, aborting.");
+        goto err_mixer;
+    }
     adev->mode = AUDIO_MODE_NORMAL;
     adev->out_device = AUDIO_DEVICE_OUT_SPEAKER;
     adev->in_device = AUDIO_DEVICE_IN_BUILTIN_MIC & ~AUDIO_DEVICE_BIT_IN;
     select_devices(adev);
+    route_wait(adev);
 
     for (i = 0; i < OUTPUT_TOTAL; i++) {
         adev->outputs[i] = NULL;
@@ -3068,6 +5185,37 @@ static int adev_open(const hw_module_t* module, const char* name,
     adev->bluetooth_nrec = true;
     adev->wb_amr = 0;
 
+    property_get(CAPTURE_WARM_STANDBY_PROPERTY, value, "0");
+    adev->capture.warm_standby_ms = (unsigned int)atoi(value);
+
+    property_get(CAPTURE_PREROLL_PROPERTY, value, "0");
+    adev->capture.preroll_ms = MIN((unsigned int)atoi(value), CAPTURE_PREROLL_MAX_MS);
+    capture_start_preroll(adev);
+
+    property_get(ECHO_DELAY_ESTIMATION_PROPERTY, value, "1");
+    adev->echo_delay_estimation = strcmp(value, "0") != 0 && strcmp(value, "false") != 0;
+
+    property_get(DC_BLOCK_DEVICES_PROPERTY, value, "");
+    adev->dc_block_devices = value[0] ? (int)strtoul(value, NULL, 0) & ~AUDIO_DEVICE_BIT_IN :
+                                        DC_BLOCK_DEVICES_DEFAULT;
+
+    property_get(DEBUG_TAP_PROPERTY, value, "0");
+    if (strcmp(value, "1") == 0 || strcmp(value, "true") == 0)
+        adev_enable_taps(adev, true);
+
+    property_get(CONFIG_WATCH_PROPERTY, value, "0");
+    if (strcmp(value, "1") == 0 || strcmp(value, "true") == 0) {
+        if (pipe(adev->config_exit_pipe) != 0) {
+            ALOGE("Unable to create the configuration watcher pipe");
+        } else if (pthread_create(&adev->config_thread, NULL, config_watch_thread, adev) != 0) {
+            ALOGE("Unable to create the configuration watcher thread");
+            close(adev->config_exit_pipe[0]);
+            close(adev->config_exit_pipe[1]);
+        } else {
+            adev->config_watch = true;
+        }
+    }
+
     /* RIL */
     ril_open(&adev->ril);
     pthread_mutex_unlock(&adev->lock);
@@ -3079,6 +5227,13 @@ static int adev_open(const hw_module_t* module, const char* name,
     return 0;
 
 err_mixer:
+    if (adev->route_next_table)
+        route_table_free(adev->route_next_table);
+    if (adev->route_stats)
+        latency_stats_destroy(adev->route_stats);
+    free(adev->route_target);
+    free(adev->route_touched);
+    mixer_shadow_destroy(adev->mixer_shadow);
     mixer_close(adev->mixer);
 err:
     return -EINVAL;
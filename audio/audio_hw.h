@@ -35,6 +35,34 @@
 #define CAPTURE_PERIOD_SIZE   1056
 #define CAPTURE_PERIOD_COUNT  2
 
+/* voice communication capture: about 10 ms periods. The rate is the default capture rate:
+ * AIF1 rates are symmetric and another rate would be refused while playback runs, or would
+ * block playback while capturing. VoIP clients resample. */
+#define VOIP_CAPTURE_PERIOD_SIZE   448
+#define VOIP_CAPTURE_PERIOD_COUNT  4
+
+/* shared capture engine: number of input streams that can read the capture PCM
+ * concurrently and minimum duration of audio kept in the ring they are served from */
+#define MAX_CAPTURE_CLIENTS   4
+#define CAPTURE_RING_MS       100
+#define CAPTURE_RING_MIN_PERIODS 2
+
+/* device routing: device and use case configurations of tiny_hw.xml, indexed in 32 bit
+ * sets, and number of merged routes kept for the combinations of configurations selected */
+#define MAX_DEV_CFGS          32
+#define ROUTE_PLAN_CACHE_SIZE 16
+
+/* capture warm standby: time the PCM and the microphone route stay open after the last
+ * input stream stops, so that a stream starting again shortly after starts immediately.
+ * Disabled unless set by the property: the microphone stays powered meanwhile. */
+#define CAPTURE_WARM_STANDBY_PROPERTY "audio.capture.warm_standby_ms"
+#define CAPTURE_IDLE_RETRY_MS         5
+
+/* capture pre-roll: when enabled the capture PCM keeps running without clients so that
+ * streams starting later get the audio captured just before them */
+#define CAPTURE_PREROLL_MAX_MS        5000
+#define CAPTURE_PREROLL_PROPERTY      "audio.capture.preroll_ms"
+
 #define SHORT_PERIOD_SIZE 192
 
 //
@@ -64,6 +92,66 @@
 /* sampling rate when using VX port for wide band */
 #define VX_WB_SAMPLING_RATE 16000
 
+/* input stream parameter returning "<frames>,<time_ns>": frames captured since the stream
+ * started and the CLOCK_MONOTONIC time at which the last of them was captured */
+#define AUDIO_PARAMETER_STREAM_CAPTURE_POSITION "capture_position"
+
+/* WM1811 input PGAs (IN1L, IN1R, IN2R Volume): 1.5 dB steps from -16.5 dB to +30 dB */
+#define IN_PGA_VOLUME_0DB    11
+#define IN_PGA_VOLUME_MAX    31
+#define IN_PGA_STEP_DB       1.5f
+/* capture gain range accepted by in_set_gain(), in dB */
+#define MIN_CAPTURE_GAIN_DB  -60.0f
+#define MAX_CAPTURE_GAIN_DB  30.0f
+
+/* input stream parameter overriding the resampler quality chosen for the audio source:
+ * "low", "default", "high" or "auto" to go back to the choice by source */
+#define AUDIO_PARAMETER_STREAM_RESAMPLER_QUALITY "resampler_quality"
+
+/* device parameter and property selecting the input devices whose capture goes through the
+ * HAL DC blocker: a mask of AUDIO_DEVICE_IN_* values. The codec high-pass filter is only
+ * enabled on the built-in mic route. */
+#define AUDIO_PARAMETER_KEY_DC_BLOCK_DEVICES "dc_block_devices"
+#define DC_BLOCK_DEVICES_PROPERTY "audio.capture.dc_block_devices"
+#define DC_BLOCK_DEVICES_DEFAULT \
+    ((AUDIO_DEVICE_IN_WIRED_HEADSET | AUDIO_DEVICE_IN_BLUETOOTH_SCO_HEADSET) & ~AUDIO_DEVICE_BIT_IN)
+#define DC_BLOCK_CUTOFF_HZ 10
+
+/* device parameter setting the capture pre-roll duration in ms, 0 disables it */
+#define AUDIO_PARAMETER_KEY_CAPTURE_PREROLL "capture_preroll_ms"
+
+/* input stream parameters enabling the dual-mic beamformer (on/off) and setting its
+ * steering delay of the sub mic in frames at the capture rate */
+#define AUDIO_PARAMETER_STREAM_BEAMFORMER "beamformer"
+#define AUDIO_PARAMETER_STREAM_BEAMFORMER_DELAY "beamformer_delay"
+#define BEAMFORMER_MAX_DELAY 32
+
+/* device parameter (on/off) and property enabling the debug taps copying the PCM data of
+ * the streams to WAV files in AUDIO_TAP_DIR */
+#define AUDIO_PARAMETER_KEY_DEBUG_TAP "debug_tap"
+#define DEBUG_TAP_PROPERTY "audio.debug.tap"
+#define AUDIO_TAP_DIR "/data/misc/media"
+
+/* directory of the mixer configuration file, named after ro.product.device */
+#define MIXER_CONFIG_DIR "/system/etc/sound"
+
+/* property enabling the reload of the mixer configuration file when it changes, to tune
+ * the routes without restarting the media server. A change is applied once the file was
+ * left untouched for CONFIG_WATCH_SETTLE_MS. */
+#define CONFIG_WATCH_PROPERTY "audio.config.watch"
+#define CONFIG_WATCH_SETTLE_MS 200
+
+/* directory of the binary route cache compiled from the mixer configuration file */
+#define ROUTE_CACHE_DIR "/data/misc/media"
+
+/* the routes of the mixer configuration file and their control names are allocated
+ * from an arena made of chunks of this size */
+#define CONFIG_ARENA_CHUNK_SIZE 4096
+
+/* property disabling the estimation of the echo delay from the echo reference and
+ * microphone signals, which refines the delay given to the AEC */
+#define ECHO_DELAY_ESTIMATION_PROPERTY "audio.aec.delay_estimation"
+
 /* product-specific defines */
 #define PRODUCT_DEVICE_PROPERTY "ro.product.device"
 #define PRODUCT_NAME_PROPERTY   "ro.product.name"
@@ -109,86 +197,49 @@ struct route_setting
     char *ctl_name;
     int intval;
     char *strval;
+    int ctl_id;                 /* id of the control in the mixer shadow */
+    bool resolved;              /* ctl_id was looked up from ctl_name */
 };
 
-struct route_setting voicecall_default[] = {
-    { .ctl_name = "HP Output Mode", .intval = 0, },
-    { .ctl_name = "AIF2 Mode", .intval = 0, },
-    { .ctl_name = "AIF2DACL Source", .intval = 0, },
-    { .ctl_name = "AIF2DACR Source", .intval = 0, },
-    { .ctl_name = "DAC1L Mixer AIF1.1 Switch", .intval = 1, },
-    { .ctl_name = "DAC1R Mixer AIF1.1 Switch", .intval = 1, },
-    { .ctl_name = "DAC1L Mixer AIF2 Switch", .intval = 1, },
-    { .ctl_name = "DAC1R Mixer AIF2 Switch", .intval = 1, },
-    { .ctl_name = "AIF2DAC Mux", .strval = "AIF2DACDAT", },
-    { .ctl_name = NULL, },
+/* microphone PGAs taking the analog part of the capture gain, see capture_update_gains() */
+enum in_pga {
+    IN_PGA_MAIN_MIC,
+    IN_PGA_HEADSET_MIC,
+    IN_PGA_SUB_MIC,
+    IN_PGA_CNT
 };
 
-struct route_setting voicecall_default_disable[] = {
-    { .ctl_name = "AIF2 Mode", .intval = 0, },
-    { .ctl_name = "AIF2DACL Source", .intval = 0, },
-    { .ctl_name = "AIF2DACR Source", .intval = 1, },
-    { .ctl_name = "DAC1L Mixer AIF2 Switch", .intval = 0, },
-    { .ctl_name = "DAC1R Mixer AIF2 Switch", .intval = 0, },
-    { .ctl_name = "AIF2DAC Mux", .strval = "AIF2DACDAT", },
-    { .ctl_name = NULL, },
+/* stages of the route changes timed for the latency statistics reported by adev_dump() */
+enum route_stage {
+    ROUTE_STAGE_QUEUE,          /* from select_devices() to the routing thread picking it up */
+    ROUTE_STAGE_MIXER,          /* mixer writes of a route */
+    ROUTE_STAGE_PCM,            /* closing and opening the modem and bluetooth PCMs */
+    ROUTE_STAGE_RIL,            /* call audio path and clock requests to the modem */
+    ROUTE_STAGE_OUTPUT,         /* select_output_device() */
+    ROUTE_STAGE_MODE,           /* select_mode() */
+    ROUTE_STAGE_CNT
 };
 
-struct route_setting default_input[] = {
-    { .ctl_name = "Main Mic Switch", .intval = 1, },
-    { .ctl_name = "IN1L Volume", .intval = 30, },
-    { .ctl_name = "MIXINL IN1L Volume", .intval = 0, },
-    { .ctl_name = "AIF1ADC1 HPF Mode", .intval = 1, },
-    { .ctl_name = "AIF1ADC1 HPF Switch", .intval = 1, },
-    { .ctl_name = NULL, },
+/* use cases: routes of tiny_hw.xml selected by the state of the HAL rather than by the
+ * devices, declared as <usecase name="..."> with on and off paths like the devices. Their
+ * paths override those of the devices, and of the use cases before them in the file. */
+enum use_case {
+    USE_CASE_DUAL_MIC_INPUT,            /* sub mic on the right ADC channel */
+    USE_CASE_VOICECALL_DEFAULT,         /* call on the speaker, earpiece or headset */
+    USE_CASE_VOICECALL_DEFAULT_DISABLE, /* call on another output */
+    USE_CASE_DEFAULT_INPUT,             /* call uplink from the main mic */
+    USE_CASE_DEFAULT_INPUT_DISABLE,
+    USE_CASE_HEADSET_INPUT,             /* call uplink from the headset mic */
+    USE_CASE_BT_INPUT,                  /* call uplink from a bluetooth headset */
+    USE_CASE_BT_OUTPUT,
+    USE_CASE_CNT
 };
 
-struct route_setting default_input_disable[] = {
-    { .ctl_name = "Main Mic Switch", .intval = 0, },
-    { .ctl_name = "AIF1ADC1 HPF Mode", .intval = 0, },
-    { .ctl_name = "AIF1ADC1 HPF Switch", .intval = 0, },
-    { .ctl_name = NULL, },
-};
-
-struct route_setting headset_input[] = {
-    { .ctl_name = "Headset Mic Switch", .intval = 1, },
-    { .ctl_name = "IN1R Volume", .intval = 9, },
-    { .ctl_name = "MIXINL IN1L Switch", .intval = 0, },
-    { .ctl_name = "MIXINL IN1L Volume", .intval = 1, },
-    { .ctl_name = "MIXINR IN1R Switch", .intval = 1, },
-    { .ctl_name = "MIXINR IN1R Volume", .intval = 1, },
-    { .ctl_name = "MIXINR IN1RP Volume", .intval = 1, },
-    { .ctl_name = "DAC2 Right Sidetone Volume", .intval = 12, },
-    { .ctl_name = "DAC2 Volume", .intval = 96, },
-    { .ctl_name = "AIF2ADC Volume", .intval = 96, },
-    { .ctl_name = "AIF1ADCL Source", .intval = 1, },
-    { .ctl_name = "AIF1ADCR Source", .intval = 1, },
-    { .ctl_name = "AIF2ADCL Source", .intval = 1, },
-    { .ctl_name = "AIF2ADCR Source", .intval = 1, },
-    { .ctl_name = NULL, },
-};
-
-struct route_setting bt_output[] = {
-    { .ctl_name = "AIF2DAC2L Mixer AIF2 Switch", .intval = 1, },
-    { .ctl_name = "AIF2DAC2R Mixer AIF2 Switch", .intval = 1, },
-    { .ctl_name = "AIF2DAC Volume", .intval = 96, },
-    { .ctl_name = "DAC2 Volume", .intval = 96, },
-    { .ctl_name = "AIF2ADC Volume", .intval = 96, },
-    { .ctl_name = NULL, },
-};
-
-struct route_setting bt_input[] = {
-    { .ctl_name = "AIF2ADC Mux", .intval = 1, },
-    { .ctl_name = "AIF2DACR Source", .intval = 1, },
-    { .ctl_name = "HP Switch", .intval = 0, },
-    { .ctl_name = "DAC1L Mixer AIF2 Switch", .intval = 1, },
-    { .ctl_name = "DAC1R Mixer AIF2 Switch", .intval = 1, },
-    { .ctl_name = "AIF1ADC1R Mixer AIF2 Switch", .intval = 0, },
-    { .ctl_name = "AIF1ADC1L Mixer AIF2 Switch", .intval = 0, },
-    { .ctl_name = "AIF2DAC2R Mixer Right Sidetone Switch", .intval = 0, },
-    { .ctl_name = "AIF2DAC2R Mixer Left Sidetone Switch", .intval = 1, },
-    { .ctl_name = "AIF1ADC1R Mixer AIF2 Switch", .intval = 0, },
-    { .ctl_name = "AIF1ADC1L Mixer AIF2 Switch", .intval = 0, },
-    { .ctl_name = "MIXINL IN1L Switch", .intval = 0, },
-    { .ctl_name = NULL, },
-};
+#define USE_CASE_BIT(use_case) (1u << (use_case))
+#define USE_CASES_CALL (USE_CASE_BIT(USE_CASE_VOICECALL_DEFAULT) | \
+                        USE_CASE_BIT(USE_CASE_VOICECALL_DEFAULT_DISABLE) | \
+                        USE_CASE_BIT(USE_CASE_DEFAULT_INPUT) | \
+                        USE_CASE_BIT(USE_CASE_DEFAULT_INPUT_DISABLE) | \
+                        USE_CASE_BIT(USE_CASE_HEADSET_INPUT) | \
+                        USE_CASE_BIT(USE_CASE_BT_INPUT) | \
+                        USE_CASE_BIT(USE_CASE_BT_OUTPUT))
@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2012 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "audio_latency.h"
+
+#define LATENCY_MAX_HISTS   64
+#define LATENCY_NUM_BUCKETS 12
+
+/* upper bounds of the buckets in ms, the last bucket holds the longer durations */
+static const unsigned int bucket_ms[LATENCY_NUM_BUCKETS - 1] = {
+    1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000,
+};
+
+struct latency_hist {
+    unsigned int stage;
+    uint32_t from;
+    uint32_t to;
+    uint32_t count;
+    int64_t total_ns;
+    int64_t max_ns;
+    uint32_t buckets[LATENCY_NUM_BUCKETS];
+};
+
+struct latency_stats {
+    pthread_mutex_t lock;
+    unsigned int num_stages;
+    struct latency_hist hists[LATENCY_MAX_HISTS];
+    unsigned int num_hists;
+    uint32_t dropped;           /* durations of the pairs without histogram */
+};
+
+struct latency_stats *latency_stats_create(unsigned int num_stages)
+{
+    struct latency_stats *stats;
+
+    stats = (struct latency_stats *)calloc(1, sizeof(struct latency_stats));
+    if (!stats)
+        return NULL;
+
+    pthread_mutex_init(&stats->lock, NULL);
+    stats->num_stages = num_stages;
+    return stats;
+}
+
+void latency_stats_destroy(struct latency_stats *stats)
+{
+    pthread_mutex_destroy(&stats->lock);
+    free(stats);
+}
+
+static unsigned int get_bucket(int64_t ns)
+{
+    unsigned int i;
+
+    for (i = 0; i < LATENCY_NUM_BUCKETS - 1; i++) {
+        if (ns < (int64_t)bucket_ms[i] * 1000000)
+            break;
+    }
+
+    return i;
+}
+
+void latency_stats_add(struct latency_stats *stats, unsigned int stage, uint32_t from,
+                       uint32_t to, int64_t ns)
+{
+    struct latency_hist *hist = NULL;
+    unsigned int i;
+
+    if (stage >= stats->num_stages)
+        return;
+    if (ns < 0)
+        ns = 0;
+
+    pthread_mutex_lock(&stats->lock);
+
+    for (i = 0; i < stats->num_hists; i++) {
+        if (stats->hists[i].stage == stage && stats->hists[i].from == from &&
+                stats->hists[i].to == to) {
+            hist = &stats->hists[i];
+            break;
+        }
+    }
+    if (!hist && stats->num_hists < LATENCY_MAX_HISTS) {
+        hist = &stats->hists[stats->num_hists++];
+        hist->stage = stage;
+        hist->from = from;
+        hist->to = to;
+    }
+
+    if (hist) {
+        hist->count++;
+        hist->total_ns += ns;
+        if (ns > hist->max_ns)
+            hist->max_ns = ns;
+        hist->buckets[get_bucket(ns)]++;
+    } else {
+        stats->dropped++;
+    }
+
+    pthread_mutex_unlock(&stats->lock);
+}
+
+static void print(int fd, const char *format, ...)
+{
+    char buf[256];
+    va_list args;
+    int len;
+
+    va_start(args, format);
+    len = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+
+    if (len > (int)sizeof(buf) - 1)
+        len = sizeof(buf) - 1;
+    if (len > 0)
+        write(fd, buf, len);
+}
+
+void latency_stats_dump(struct latency_stats *stats, int fd, const char * const *stage_names)
+{
+    struct latency_hist hists[LATENCY_MAX_HISTS];
+    struct latency_hist *hist;
+    unsigned int num_hists;
+    uint32_t dropped;
+    char line[256];
+    char bound[16];
+    unsigned int stage;
+    unsigned int i, j;
+    size_t len;
+
+    /* the routing and stream threads record durations: the mutex is not held across write() */
+    pthread_mutex_lock(&stats->lock);
+    num_hists = stats->num_hists;
+    memcpy(hists, stats->hists, num_hists * sizeof(hists[0]));
+    dropped = stats->dropped;
+    pthread_mutex_unlock(&stats->lock);
+
+    len = snprintf(line, sizeof(line), "  %-10s %-18s %6s %8s %8s",
+                   "stage", "devices", "count", "mean ms", "max ms");
+    for (j = 0; j < LATENCY_NUM_BUCKETS - 1 && len < sizeof(line); j++) {
+        snprintf(bound, sizeof(bound), "<%u", bucket_ms[j]);
+        len += snprintf(line + len, sizeof(line) - len, " %6s", bound);
+    }
+    print(fd, "%s %6s\n", line, "more");
+
+    /* grouped by stage, in the order the pairs were first seen */
+    for (stage = 0; stage < stats->num_stages; stage++) {
+        for (i = 0; i < num_hists; i++) {
+            hist = &hists[i];
+            if (hist->stage != stage)
+                continue;
+
+            len = snprintf(line, sizeof(line), "  %-10s %08x->%08x %6u %8.2f %8.2f",
+                           stage_names[stage], hist->from, hist->to, hist->count,
+                           (double)hist->total_ns / hist->count / 1000000,
+                           (double)hist->max_ns / 1000000);
+            for (j = 0; j < LATENCY_NUM_BUCKETS && len < sizeof(line); j++)
+                len += snprintf(line + len, sizeof(line) - len, " %6u", hist->buckets[j]);
+            print(fd, "%s\n", line);
+        }
+    }
+
+    if (dropped)
+        print(fd, "  %u durations of other device pairs not shown\n", dropped);
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2012 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUDIO_LATENCY_H
+#define AUDIO_LATENCY_H
+
+#include <stdint.h>
+
+/* Latency statistics: histograms of the durations of the stages of the route changes, one
+ * per stage and pair of devices changed between. Thread safe, recording only takes a
+ * short internal lock that is never held while acquiring another one. */
+
+struct latency_stats;
+
+struct latency_stats *latency_stats_create(unsigned int num_stages);
+void latency_stats_destroy(struct latency_stats *stats);
+
+/* records the duration of a stage of a change from the devices from to the devices to.
+ * Pairs beyond the number of histograms kept are only counted. */
+void latency_stats_add(struct latency_stats *stats, unsigned int stage, uint32_t from,
+                       uint32_t to, int64_t ns);
+
+/* prints the histograms to the file descriptor, stage_names is indexed by stage */
+void latency_stats_dump(struct latency_stats *stats, int fd, const char * const *stage_names);
+
+#endif
@@ -0,0 +1,235 @@
+/*
+ * Copyright (C) 2012 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_primary"
+/*#define LOG_NDEBUG 0*/
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cutils/log.h>
+#include <tinyalsa/asoundlib.h>
+
+#include "audio_mixer.h"
+
+/* controls with more values, e.g. coefficient blobs, are always written */
+#define MIXER_SHADOW_MAX_VALUES 8
+
+struct shadow_ctl {
+    struct mixer_ctl *ctl;
+    uint32_t offset;            /* of the first value in values[] */
+    uint16_t num_values;
+    uint8_t type;               /* enum mixer_ctl_type */
+    bool known;                 /* values[] holds what the control is set to */
+};
+
+struct mixer_shadow {
+    struct mixer *mixer;
+    unsigned int num_ctls;
+    struct shadow_ctl *ctls;
+    int32_t *values;
+};
+
+struct mixer_shadow *mixer_shadow_create(struct mixer *mixer)
+{
+    struct mixer_shadow *shadow;
+    uint32_t num_values = 0;
+    unsigned int i;
+
+    shadow = (struct mixer_shadow *)calloc(1, sizeof(struct mixer_shadow));
+    if (!shadow)
+        return NULL;
+
+    shadow->mixer = mixer;
+    shadow->num_ctls = mixer_get_num_ctls(mixer);
+    shadow->ctls = (struct shadow_ctl *)calloc(shadow->num_ctls, sizeof(struct shadow_ctl));
+    if (!shadow->ctls)
+        goto err;
+
+    for (i = 0; i < shadow->num_ctls; i++) {
+        struct shadow_ctl *sc = &shadow->ctls[i];
+
+        sc->ctl = mixer_get_ctl(mixer, i);
+        sc->num_values = mixer_ctl_get_num_values(sc->ctl);
+        sc->type = (uint8_t)mixer_ctl_get_type(sc->ctl);
+        sc->offset = num_values;
+        if (sc->num_values <= MIXER_SHADOW_MAX_VALUES)
+            num_values += sc->num_values;
+    }
+
+    shadow->values = (int32_t *)calloc(num_values ? num_values : 1, sizeof(int32_t));
+    if (!shadow->values)
+        goto err;
+
+    ALOGV("%s: %u controls, %u values", __func__, shadow->num_ctls, num_values);
+    return shadow;
+
+err:
+    free(shadow->ctls);
+    free(shadow);
+    return NULL;
+}
+
+void mixer_shadow_destroy(struct mixer_shadow *shadow)
+{
+    free(shadow->values);
+    free(shadow->ctls);
+    free(shadow);
+}
+
+unsigned int mixer_shadow_get_num_ctls(struct mixer_shadow *shadow)
+{
+    return shadow->num_ctls;
+}
+
+int mixer_shadow_find(struct mixer_shadow *shadow, const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; i < shadow->num_ctls; i++) {
+        if (strcmp(mixer_ctl_get_name(shadow->ctls[i].ctl), name) == 0)
+            return (int)i;
+    }
+
+    return -1;
+}
+
+struct mixer_ctl *mixer_shadow_get_ctl(struct mixer_shadow *shadow, int id)
+{
+    if (id < 0 || (unsigned int)id >= shadow->num_ctls)
+        return NULL;
+
+    return shadow->ctls[id].ctl;
+}
+
+static int write_values(struct shadow_ctl *sc, int value)
+{
+    unsigned int i;
+    int ret = 0;
+
+#if defined(MIXER_HAS_SET_ARRAY)
+    /* all the values of the control in a single ioctl. mixer_ctl_set_array() copies the
+     * array as the kernel stores the values: long for integers and booleans, unsigned int
+     * for enumerated items. */
+    if (sc->num_values > 1 && sc->num_values <= MIXER_SHADOW_MAX_VALUES) {
+        switch (sc->type) {
+        case MIXER_CTL_TYPE_BOOL:
+        case MIXER_CTL_TYPE_INT: {
+            long values[MIXER_SHADOW_MAX_VALUES];
+
+            for (i = 0; i < sc->num_values; i++)
+                values[i] = value;
+            return mixer_ctl_set_array(sc->ctl, values, sc->num_values);
+        }
+        case MIXER_CTL_TYPE_ENUM: {
+            unsigned int values[MIXER_SHADOW_MAX_VALUES];
+
+            for (i = 0; i < sc->num_values; i++)
+                values[i] = (unsigned int)value;
+            return mixer_ctl_set_array(sc->ctl, values, sc->num_values);
+        }
+        default:
+            break;
+        }
+    }
+#endif
+
+    for (i = 0; i < sc->num_values; i++) {
+        if (mixer_ctl_set_value(sc->ctl, i, value) != 0)
+            ret = -EINVAL;
+    }
+
+    return ret;
+}
+
+int mixer_shadow_set_int(struct mixer_shadow *shadow, int id, int value)
+{
+    struct shadow_ctl *sc;
+    int32_t *values;
+    unsigned int i;
+    int ret;
+
+    if (id < 0 || (unsigned int)id >= shadow->num_ctls)
+        return -EINVAL;
+
+    sc = &shadow->ctls[id];
+    values = shadow->values + sc->offset;
+
+    if (sc->known) {
+        for (i = 0; i < sc->num_values; i++) {
+            if (values[i] != value)
+                break;
+        }
+        if (i == sc->num_values)
+            return 0;
+    }
+
+    ret = write_values(sc, value);
+    /* after a failure the state of the control is not known */
+    sc->known = ret == 0 && sc->num_values <= MIXER_SHADOW_MAX_VALUES;
+    if (sc->known) {
+        for (i = 0; i < sc->num_values; i++)
+            values[i] = value;
+    }
+
+    return ret;
+}
+
+int mixer_shadow_set_enum(struct mixer_shadow *shadow, int id, const char *string)
+{
+    struct shadow_ctl *sc;
+    unsigned int num_enums;
+    unsigned int item;
+    int ret;
+
+    if (id < 0 || (unsigned int)id >= shadow->num_ctls)
+        return -EINVAL;
+
+    sc = &shadow->ctls[id];
+    num_enums = mixer_ctl_get_num_enums(sc->ctl);
+    for (item = 0; item < num_enums; item++) {
+        if (strcmp(mixer_ctl_get_enum_string(sc->ctl, item), string) == 0)
+            break;
+    }
+    if (item == num_enums)
+        return -EINVAL;
+
+    /* mixer_ctl_set_enum_by_string() only sets the first value: enums with several values
+     * get the item in all of them like integer controls */
+    if (sc->num_values > 1)
+        return mixer_shadow_set_int(shadow, id, (int)item);
+
+    if (sc->known && shadow->values[sc->offset] == (int32_t)item)
+        return 0;
+
+    ret = mixer_ctl_set_enum_by_string(sc->ctl, string);
+    sc->known = ret == 0 && sc->num_values <= MIXER_SHADOW_MAX_VALUES;
+    if (sc->known)
+        shadow->values[sc->offset] = (int32_t)item;
+
+    return ret;
+}
+
+void mixer_shadow_invalidate(struct mixer_shadow *shadow)
+{
+    unsigned int i;
+
+    for (i = 0; i < shadow->num_ctls; i++)
+        shadow->ctls[i].known = false;
+}
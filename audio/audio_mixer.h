@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2012 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUDIO_MIXER_H
+#define AUDIO_MIXER_H
+
+struct mixer;
+struct mixer_ctl;
+
+/* Mixer shadow: keeps a copy of the values last written to the mixer controls, indexed by
+ * control id, so that writing a value a control already has does not reach the driver.
+ * A control is only known after its first write through the shadow: all the writes to the
+ * controls must then go through it. Not thread safe: the callers serialize the writes. */
+
+struct mixer_shadow;
+
+struct mixer_shadow *mixer_shadow_create(struct mixer *mixer);
+void mixer_shadow_destroy(struct mixer_shadow *shadow);
+
+/* control ids range from 0 to the number of controls - 1 */
+unsigned int mixer_shadow_get_num_ctls(struct mixer_shadow *shadow);
+/* returns the id of the control named, -1 if there is none */
+int mixer_shadow_find(struct mixer_shadow *shadow, const char *name);
+struct mixer_ctl *mixer_shadow_get_ctl(struct mixer_shadow *shadow, int id);
+
+/* sets all the values of an integer, boolean or enumerated control */
+int mixer_shadow_set_int(struct mixer_shadow *shadow, int id, int value);
+/* sets all the values of an enumerated control to the item named */
+int mixer_shadow_set_enum(struct mixer_shadow *shadow, int id, const char *string);
+
+/* forgets the values of all the controls, the next writes reach the driver */
+void mixer_shadow_invalidate(struct mixer_shadow *shadow);
+
+#endif
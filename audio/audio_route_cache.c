@@ -0,0 +1,416 @@
+/*
+ * Copyright (C) 2012 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_primary"
+/*#define LOG_NDEBUG 0*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cutils/log.h>
+
+#include "audio_route_cache.h"
+
+#define ROUTE_CACHE_MAGIC   0x52544331  /* "RTC1" */
+#define ROUTE_CACHE_VERSION 2
+
+/* image layout: header, paths, entries, string table. Strings are offsets in the string
+ * table, which starts with an empty string used for the integer values. */
+struct cache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;              /* of the whole image */
+    uint32_t source_hash;
+    int64_t source_mtime;
+    int64_t source_size;
+    uint32_t num_paths;
+    uint32_t num_entries;
+    uint32_t strings_size;
+    uint32_t names_hash;
+};
+
+struct cache_path {
+    int32_t mask;
+    uint32_t kind;
+    uint32_t first;             /* index of the first entry */
+    uint32_t count;
+};
+
+struct cache_entry {
+    uint32_t name;
+    int32_t intval;
+    uint32_t strval;
+};
+
+struct route_cache_writer {
+    struct cache_path *paths;
+    uint32_t num_paths;
+    uint32_t max_paths;
+    struct cache_entry *entries;
+    uint32_t num_entries;
+    uint32_t max_entries;
+    char *strings;
+    uint32_t strings_size;
+    uint32_t max_strings;
+};
+
+struct route_cache {
+    void *image;
+    size_t size;
+    const struct cache_header *header;
+    const struct cache_path *paths;
+    const struct cache_entry *entries;
+    const char *strings;
+};
+
+/* FNV-1a */
+uint32_t route_cache_hash(uint32_t h, const void *buf, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+void route_cache_get_source(struct route_cache_source *source, const void *buf, size_t len,
+                            int64_t mtime, uint32_t names_hash)
+{
+    source->hash = route_cache_hash(ROUTE_CACHE_HASH_INIT, buf, len);
+    source->mtime = mtime;
+    source->size = (int64_t)len;
+    source->names_hash = names_hash;
+}
+
+/* reads the source file to check an image against it */
+static int read_source(const char *path, struct route_cache_source *source)
+{
+    unsigned char buf[1024];
+    struct stat st;
+    uint32_t h = ROUTE_CACHE_HASH_INIT;
+    ssize_t len;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -errno;
+
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -errno;
+    }
+
+    while ((len = read(fd, buf, sizeof(buf))) > 0)
+        h = route_cache_hash(h, buf, len);
+    close(fd);
+    if (len < 0)
+        return -EIO;
+
+    source->hash = h;
+    source->mtime = (int64_t)st.st_mtime;
+    source->size = (int64_t)st.st_size;
+    return 0;
+}
+
+/* grows an array of the writer to hold at least count elements */
+static int grow(void **array, uint32_t *max, uint32_t count, size_t size)
+{
+    uint32_t new_max = *max ? *max : 16;
+    void *p;
+
+    if (count <= *max)
+        return 0;
+
+    while (new_max < count)
+        new_max *= 2;
+    p = realloc(*array, new_max * size);
+    if (!p)
+        return -ENOMEM;
+
+    *array = p;
+    *max = new_max;
+    return 0;
+}
+
+static int add_string(struct route_cache_writer *w, const char *s, uint32_t *offset)
+{
+    uint32_t len = strlen(s) + 1;
+
+    if (grow((void **)&w->strings, &w->max_strings, w->strings_size + len, 1) != 0)
+        return -ENOMEM;
+
+    memcpy(w->strings + w->strings_size, s, len);
+    *offset = w->strings_size;
+    w->strings_size += len;
+    return 0;
+}
+
+struct route_cache_writer *route_cache_writer_create(void)
+{
+    struct route_cache_writer *w;
+    uint32_t empty;
+
+    w = (struct route_cache_writer *)calloc(1, sizeof(struct route_cache_writer));
+    if (!w)
+        return NULL;
+
+    if (add_string(w, "", &empty) != 0) {
+        free(w);
+        return NULL;
+    }
+
+    return w;
+}
+
+void route_cache_writer_destroy(struct route_cache_writer *w)
+{
+    free(w->paths);
+    free(w->entries);
+    free(w->strings);
+    free(w);
+}
+
+int route_cache_add_path(struct route_cache_writer *w, int mask, enum route_cache_kind kind)
+{
+    struct cache_path *path;
+
+    if (grow((void **)&w->paths, &w->max_paths, w->num_paths + 1, sizeof(*path)) != 0)
+        return -ENOMEM;
+
+    path = &w->paths[w->num_paths++];
+    path->mask = mask;
+    path->kind = kind;
+    path->first = w->num_entries;
+    path->count = 0;
+    return 0;
+}
+
+int route_cache_add_ctl(struct route_cache_writer *w, const char *name, int intval,
+                        const char *strval)
+{
+    struct cache_entry *entry;
+
+    if (w->num_paths == 0)
+        return -EINVAL;
+
+    if (grow((void **)&w->entries, &w->max_entries, w->num_entries + 1, sizeof(*entry)) != 0)
+        return -ENOMEM;
+
+    entry = &w->entries[w->num_entries];
+    entry->intval = intval;
+    entry->strval = 0;
+    if (add_string(w, name, &entry->name) != 0)
+        return -ENOMEM;
+    if (strval && add_string(w, strval, &entry->strval) != 0)
+        return -ENOMEM;
+
+    w->num_entries++;
+    w->paths[w->num_paths - 1].count++;
+    return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t size)
+{
+    const char *p = (const char *)buf;
+    ssize_t ret;
+
+    while (size > 0) {
+        ret = write(fd, p, size);
+        if (ret < 0)
+            return -errno;
+        p += ret;
+        size -= ret;
+    }
+
+    return 0;
+}
+
+int route_cache_write(struct route_cache_writer *w, const char *path,
+                      const struct route_cache_source *source)
+{
+    struct cache_header header;
+    char tmp[PATH_MAX];
+    int ret;
+    int fd;
+
+    memset(&header, 0, sizeof(header));
+    header.source_hash = source->hash;
+    header.source_mtime = source->mtime;
+    header.source_size = source->size;
+    header.names_hash = source->names_hash;
+    header.magic = ROUTE_CACHE_MAGIC;
+    header.version = ROUTE_CACHE_VERSION;
+    header.num_paths = w->num_paths;
+    header.num_entries = w->num_entries;
+    header.strings_size = w->strings_size;
+    header.size = sizeof(header) + w->num_paths * sizeof(struct cache_path) +
+                      w->num_entries * sizeof(struct cache_entry) + w->strings_size;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0640);
+    if (fd < 0)
+        return -errno;
+
+    ret = write_all(fd, &header, sizeof(header));
+    if (ret == 0)
+        ret = write_all(fd, w->paths, w->num_paths * sizeof(struct cache_path));
+    if (ret == 0)
+        ret = write_all(fd, w->entries, w->num_entries * sizeof(struct cache_entry));
+    if (ret == 0)
+        ret = write_all(fd, w->strings, w->strings_size);
+    if (ret == 0 && fsync(fd) != 0)
+        ret = -errno;
+    close(fd);
+
+    if (ret == 0 && rename(tmp, path) != 0)
+        ret = -errno;
+    if (ret != 0)
+        unlink(tmp);
+
+    return ret;
+}
+
+/* checks that all the offsets of the image stay within it */
+static bool cache_is_valid(struct route_cache *cache)
+{
+    const struct cache_header *h = cache->header;
+    uint32_t i;
+
+    if (h->strings_size == 0 || cache->strings[h->strings_size - 1] != '\0')
+        return false;
+
+    for (i = 0; i < h->num_paths; i++) {
+        if (cache->paths[i].kind > ROUTE_CACHE_USE_CASE ||
+                cache->paths[i].first > h->num_entries ||
+                cache->paths[i].count > h->num_entries - cache->paths[i].first)
+            return false;
+    }
+
+    for (i = 0; i < h->num_entries; i++) {
+        if (cache->entries[i].name >= h->strings_size ||
+                cache->entries[i].strval >= h->strings_size)
+            return false;
+    }
+
+    return true;
+}
+
+struct route_cache *route_cache_open(const char *path, const char *source, uint32_t names_hash)
+{
+    struct route_cache *cache;
+    const struct cache_header *h;
+    struct route_cache_source current;
+    struct stat st;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct cache_header)) {
+        close(fd);
+        return NULL;
+    }
+
+    cache = (struct route_cache *)calloc(1, sizeof(struct route_cache));
+    if (!cache) {
+        close(fd);
+        return NULL;
+    }
+
+    cache->size = st.st_size;
+    cache->image = mmap(NULL, cache->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (cache->image == MAP_FAILED) {
+        free(cache);
+        return NULL;
+    }
+
+    h = cache->header = (const struct cache_header *)cache->image;
+    if (h->magic != ROUTE_CACHE_MAGIC || h->version != ROUTE_CACHE_VERSION ||
+            h->size != cache->size ||
+            (uint64_t)sizeof(*h) + (uint64_t)h->num_paths * sizeof(struct cache_path) +
+                (uint64_t)h->num_entries * sizeof(struct cache_entry) +
+                h->strings_size != h->size) {
+        ALOGW("%s: %s is not a valid route cache", __func__, path);
+        goto err;
+    }
+
+    cache->paths = (const struct cache_path *)(h + 1);
+    cache->entries = (const struct cache_entry *)(cache->paths + h->num_paths);
+    cache->strings = (const char *)(cache->entries + h->num_entries);
+    if (!cache_is_valid(cache)) {
+        ALOGW("%s: %s is corrupted", __func__, path);
+        goto err;
+    }
+
+    if (read_source(source, &current) != 0 || current.hash != h->source_hash ||
+            current.mtime != h->source_mtime || current.size != h->source_size ||
+            names_hash != h->names_hash) {
+        ALOGV("%s: %s is out of date", __func__, path);
+        goto err;
+    }
+
+    return cache;
+
+err:
+    munmap(cache->image, cache->size);
+    free(cache);
+    return NULL;
+}
+
+void route_cache_close(struct route_cache *cache)
+{
+    munmap(cache->image, cache->size);
+    free(cache);
+}
+
+unsigned int route_cache_num_paths(struct route_cache *cache)
+{
+    return cache->header->num_paths;
+}
+
+unsigned int route_cache_get_path(struct route_cache *cache, unsigned int index,
+                                  int *mask, enum route_cache_kind *kind)
+{
+    const struct cache_path *path = &cache->paths[index];
+
+    *mask = path->mask;
+    *kind = (enum route_cache_kind)path->kind;
+    return path->count;
+}
+
+void route_cache_get_ctl(struct route_cache *cache, unsigned int path, unsigned int index,
+                         const char **name, int *intval, const char **strval)
+{
+    const struct cache_entry *entry = &cache->entries[cache->paths[path].first + index];
+
+    *name = cache->strings + entry->name;
+    *intval = entry->intval;
+    *strval = entry->strval ? cache->strings + entry->strval : NULL;
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2012 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUDIO_ROUTE_CACHE_H
+#define AUDIO_ROUTE_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Route cache: binary image of the paths parsed from the mixer configuration file, in the
+ * order they appear in it. The image is mapped read-only on the next start instead of
+ * parsing the file again, as long as the size, modification time and hash of the file
+ * still match those recorded in the image. The image holds the masks the device and use
+ * case names were mapped to: the hash of the tables mapping them is recorded too. */
+
+enum route_cache_kind {
+    ROUTE_CACHE_DEFAULT,        /* path outside of a device, applied when loaded */
+    ROUTE_CACHE_ON,
+    ROUTE_CACHE_OFF,
+    ROUTE_CACHE_DEVICE,         /* start of a device, the on and off paths next belong to it */
+    ROUTE_CACHE_USE_CASE,       /* same for a use case, the mask is its index */
+};
+
+struct route_cache_writer;
+struct route_cache;
+
+/* version of the source file an image is written for */
+struct route_cache_source {
+    uint32_t hash;
+    int64_t mtime;
+    int64_t size;
+    uint32_t names_hash;        /* of the tables mapping the names of the file to masks */
+};
+
+#define ROUTE_CACHE_HASH_INIT 2166136261u
+
+/* returns the hash h, starting from ROUTE_CACHE_HASH_INIT, updated with the bytes of buf */
+uint32_t route_cache_hash(uint32_t h, const void *buf, size_t len);
+
+/* fills source from the contents of the source file, its modification time and the hash of
+ * the name tables */
+void route_cache_get_source(struct route_cache_source *source, const void *buf, size_t len,
+                            int64_t mtime, uint32_t names_hash);
+
+struct route_cache_writer *route_cache_writer_create(void);
+void route_cache_writer_destroy(struct route_cache_writer *w);
+/* starts a path, the controls added next belong to it */
+int route_cache_add_path(struct route_cache_writer *w, int mask, enum route_cache_kind kind);
+/* strval is NULL for integer values */
+int route_cache_add_ctl(struct route_cache_writer *w, const char *name, int intval,
+                        const char *strval);
+/* writes the image for the version of the source file specified, replacing any previous one
+ * atomically */
+int route_cache_write(struct route_cache_writer *w, const char *path,
+                      const struct route_cache_source *source);
+
+/* maps the image if it was written for the current version of the source file and the
+ * name tables of names_hash, returns NULL otherwise */
+struct route_cache *route_cache_open(const char *path, const char *source, uint32_t names_hash);
+void route_cache_close(struct route_cache *cache);
+
+unsigned int route_cache_num_paths(struct route_cache *cache);
+/* returns the number of controls of a path */
+unsigned int route_cache_get_path(struct route_cache *cache, unsigned int index,
+                                  int *mask, enum route_cache_kind *kind);
+/* the strings point into the image and stay valid until it is closed */
+void route_cache_get_ctl(struct route_cache *cache, unsigned int path, unsigned int index,
+                         const char **name, int *intval, const char **strval);
+
+#endif
@@ -0,0 +1,343 @@
+/*
+ * Copyright (C) 2012 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_primary"
+/*#define LOG_NDEBUG 0*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cutils/atomic.h>
+#include <cutils/log.h>
+#include <cutils/sched_policy.h>
+#include <system/thread_defs.h>
+
+#include "audio_tap.h"
+
+#define TAP_RING_SIZE       (256 * 1024)    /* power of 2, about 1.5 s of 44.1 kHz stereo */
+#define TAP_MAX_TAPS        8
+#define TAP_DRAIN_PERIOD_MS 20
+#define TAP_NAME_MAX        64
+#define WAV_HEADER_SIZE     44
+
+struct tap {
+    /* ring shared with the writer thread: wr is only modified by tap_write() and rd only by
+     * the writer thread, both are free running byte counters */
+    volatile int32_t wr;
+    volatile int32_t rd;
+    volatile int32_t closed;
+    volatile int32_t overruns;
+    uint8_t *ring;
+
+    char name[TAP_NAME_MAX];
+    struct timespec opened;     /* CLOCK_REALTIME, the file is named by the writer thread */
+    unsigned int rate;
+    unsigned int channels;
+    int fd;
+    uint32_t data_size;
+};
+
+struct tap_writer {
+    pthread_mutex_t lock;       /* protects taps[] and exit */
+    pthread_cond_t cond;
+    pthread_t thread;
+    bool exit;
+    char dir[PATH_MAX];
+    struct tap *taps[TAP_MAX_TAPS];     /* open taps, taps[i] uses pool[i] */
+    struct tap pool[TAP_MAX_TAPS];
+};
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static void put_le16(uint8_t *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void make_wav_header(uint8_t *h, struct tap *tap)
+{
+    uint32_t block_align = tap->channels * sizeof(int16_t);
+
+    memcpy(h, "RIFF", 4);
+    put_le32(h + 4, WAV_HEADER_SIZE - 8 + tap->data_size);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    put_le32(h + 16, 16);
+    put_le16(h + 20, 1);        /* PCM */
+    put_le16(h + 22, tap->channels);
+    put_le32(h + 24, tap->rate);
+    put_le32(h + 28, tap->rate * block_align);
+    put_le16(h + 32, block_align);
+    put_le16(h + 34, 16);
+    memcpy(h + 36, "data", 4);
+    put_le32(h + 40, tap->data_size);
+}
+
+static void tap_create_file(struct tap_writer *writer, struct tap *tap)
+{
+    uint8_t header[WAV_HEADER_SIZE];
+    char path[PATH_MAX];
+    char date[32];
+    struct tm tm;
+
+    localtime_r(&tap->opened.tv_sec, &tm);
+    strftime(date, sizeof(date), "%Y%m%d-%H%M%S", &tm);
+    snprintf(path, sizeof(path), "%s/%s-%s.%03ld.wav", writer->dir, tap->name, date,
+             tap->opened.tv_nsec / 1000000);
+    tap->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0640);
+    if (tap->fd < 0) {
+        ALOGE("%s: cannot create %s: %s", __func__, path, strerror(errno));
+        return;
+    }
+
+    make_wav_header(header, tap);
+    if (write(tap->fd, header, sizeof(header)) != sizeof(header)) {
+        ALOGE("%s: cannot write %s: %s", __func__, path, strerror(errno));
+        close(tap->fd);
+        tap->fd = -1;
+        return;
+    }
+    ALOGI("%s: writing %s", __func__, path);
+}
+
+/* writes the frames available in the ring to the file. Returns true when the tap is
+ * closed and nothing is left to write. */
+static bool tap_drain(struct tap_writer *writer, struct tap *tap)
+{
+    bool closed = android_atomic_acquire_load(&tap->closed) != 0;
+    uint32_t wr = (uint32_t)android_atomic_acquire_load(&tap->wr);
+    uint32_t rd = (uint32_t)tap->rd;
+
+    if (tap->fd < 0 && wr != rd)
+        tap_create_file(writer, tap);
+
+    while (wr != rd) {
+        uint32_t offset = rd & (TAP_RING_SIZE - 1);
+        uint32_t count = wr - rd;
+        ssize_t ret;
+
+        if (count > TAP_RING_SIZE - offset)
+            count = TAP_RING_SIZE - offset;
+
+        /* data is consumed even if it cannot be written so that the ring does not stall */
+        if (tap->fd >= 0) {
+            ret = write(tap->fd, tap->ring + offset, count);
+            if (ret != (ssize_t)count) {
+                ALOGE("%s: write error on %s: %s", __func__, tap->name, strerror(errno));
+                close(tap->fd);
+                tap->fd = -1;
+            } else {
+                tap->data_size += count;
+            }
+        }
+        rd += count;
+    }
+    android_atomic_release_store((int32_t)rd, &tap->rd);
+
+    return closed;
+}
+
+/* completes and closes the file of a closed tap */
+static void tap_finish(struct tap *tap)
+{
+    uint8_t header[WAV_HEADER_SIZE];
+
+    if (tap->fd >= 0) {
+        make_wav_header(header, tap);
+        if (pwrite(tap->fd, header, sizeof(header), 0) != sizeof(header))
+            ALOGE("%s: cannot complete header of %s", __func__, tap->name);
+        close(tap->fd);
+        tap->fd = -1;
+    }
+    if (tap->overruns)
+        ALOGW("%s: %s dropped %d buffers", __func__, tap->name, tap->overruns);
+}
+
+static void *tap_writer_thread(void *context)
+{
+    struct tap_writer *writer = (struct tap_writer *)context;
+    struct timespec ts;
+    struct tap *tap;
+    bool exit = false;
+    int i;
+
+    /* file writes must never compete with the audio threads */
+    setpriority(PRIO_PROCESS, 0, ANDROID_PRIORITY_BACKGROUND);
+    set_sched_policy(0, SP_BACKGROUND);
+
+    while (!exit) {
+        pthread_mutex_lock(&writer->lock);
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += TAP_DRAIN_PERIOD_MS * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_nsec -= 1000000000;
+            ts.tv_sec++;
+        }
+        if (!writer->exit)
+            pthread_cond_timedwait(&writer->cond, &writer->lock, &ts);
+        exit = writer->exit;
+        pthread_mutex_unlock(&writer->lock);
+
+        /* only this thread removes taps: they can be drained without the lock */
+        for (i = 0; i < TAP_MAX_TAPS; i++) {
+            pthread_mutex_lock(&writer->lock);
+            tap = writer->taps[i];
+            pthread_mutex_unlock(&writer->lock);
+
+            if (tap == NULL)
+                continue;
+
+            if (tap_drain(writer, tap) || exit) {
+                tap_finish(tap);
+                pthread_mutex_lock(&writer->lock);
+                writer->taps[i] = NULL;
+                pthread_mutex_unlock(&writer->lock);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static void tap_writer_free(struct tap_writer *writer)
+{
+    int i;
+
+    for (i = 0; i < TAP_MAX_TAPS; i++)
+        free(writer->pool[i].ring);
+    free(writer);
+}
+
+struct tap_writer *tap_writer_create(const char *dir)
+{
+    struct tap_writer *writer;
+    int i;
+
+    writer = (struct tap_writer *)calloc(1, sizeof(struct tap_writer));
+    if (!writer)
+        return NULL;
+
+    for (i = 0; i < TAP_MAX_TAPS; i++) {
+        writer->pool[i].ring = (uint8_t *)malloc(TAP_RING_SIZE);
+        if (!writer->pool[i].ring) {
+            tap_writer_free(writer);
+            return NULL;
+        }
+    }
+
+    snprintf(writer->dir, sizeof(writer->dir), "%s", dir);
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->cond, NULL);
+
+    if (pthread_create(&writer->thread, NULL, tap_writer_thread, writer) != 0) {
+        ALOGE("%s: cannot create writer thread", __func__);
+        tap_writer_free(writer);
+        return NULL;
+    }
+
+    return writer;
+}
+
+void tap_writer_destroy(struct tap_writer *writer)
+{
+    pthread_mutex_lock(&writer->lock);
+    writer->exit = true;
+    pthread_cond_signal(&writer->cond);
+    pthread_mutex_unlock(&writer->lock);
+
+    pthread_join(writer->thread, NULL);
+    tap_writer_free(writer);
+}
+
+struct tap *tap_open(struct tap_writer *writer, const char *name,
+                     unsigned int rate, unsigned int channels)
+{
+    struct tap *tap = NULL;
+    int i;
+
+    pthread_mutex_lock(&writer->lock);
+    for (i = 0; i < TAP_MAX_TAPS; i++) {
+        if (writer->taps[i] == NULL) {
+            tap = &writer->pool[i];
+            break;
+        }
+    }
+
+    if (tap == NULL) {
+        pthread_mutex_unlock(&writer->lock);
+        ALOGW("%s: too many taps, %s not recorded", __func__, name);
+        return NULL;
+    }
+
+    /* the writer thread does not access a tap out of taps[] */
+    tap->wr = 0;
+    tap->rd = 0;
+    tap->closed = 0;
+    tap->overruns = 0;
+    snprintf(tap->name, sizeof(tap->name), "%s", name);
+    clock_gettime(CLOCK_REALTIME, &tap->opened);
+    tap->rate = rate;
+    tap->channels = channels;
+    tap->fd = -1;
+    tap->data_size = 0;
+    writer->taps[i] = tap;
+    pthread_mutex_unlock(&writer->lock);
+
+    return tap;
+}
+
+void tap_close(struct tap *tap)
+{
+    android_atomic_release_store(1, &tap->closed);
+}
+
+void tap_write(struct tap *tap, const void *buffer, size_t bytes)
+{
+    uint32_t wr = (uint32_t)tap->wr;
+    uint32_t rd = (uint32_t)android_atomic_acquire_load(&tap->rd);
+    uint32_t offset = wr & (TAP_RING_SIZE - 1);
+    size_t count;
+
+    /* drop whole buffers to keep the file frame aligned */
+    if (bytes > TAP_RING_SIZE - (wr - rd)) {
+        android_atomic_inc(&tap->overruns);
+        return;
+    }
+
+    count = bytes;
+    if (count > TAP_RING_SIZE - offset)
+        count = TAP_RING_SIZE - offset;
+    memcpy(tap->ring + offset, buffer, count);
+    memcpy(tap->ring, (const uint8_t *)buffer + count, bytes - count);
+
+    android_atomic_release_store((int32_t)(wr + bytes), &tap->wr);
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2012 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUDIO_TAP_H
+#define AUDIO_TAP_H
+
+#include <stddef.h>
+
+/* Debug taps copy the PCM data of a stream to a WAV file. tap_write() only copies the data
+ * to a lock-free ring: it can be called from the audio threads without blocking. A low
+ * priority writer thread drains the rings of all the taps to their files.
+ * The taps and their rings are allocated with the writer: tap_open() and tap_close() do not
+ * allocate memory or access files and can also be called from the audio threads. */
+
+struct tap_writer;
+struct tap;
+
+/* allocates the taps and starts the writer thread, files are created in the directory
+ * specified */
+struct tap_writer *tap_writer_create(const char *dir);
+/* writes what is left in the rings of the open taps, closes them, stops the thread and
+ * frees the taps */
+void tap_writer_destroy(struct tap_writer *writer);
+
+/* opens a tap for 16 bit PCM. The file name starts with the name specified and ends with
+ * the time the tap was opened. Returns NULL if all the taps are in use. */
+struct tap *tap_open(struct tap_writer *writer, const char *name,
+                     unsigned int rate, unsigned int channels);
+/* the writer thread drains the ring, completes the WAV header and releases the tap */
+void tap_close(struct tap *tap);
+/* data that does not fit in the ring is dropped */
+void tap_write(struct tap *tap, const void *buffer, size_t bytes);
+
+#endif